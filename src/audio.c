@@ -0,0 +1,85 @@
+#include "audio.h"
+#include <stdio.h>
+#include <string.h>
+
+// The most the sample rate gets nudged to keep the ring near its target.
+// Half a percent changes the pitch too little to hear.
+#define MAX_RATE_DRIFT 0.005
+
+static void audio_callback(void *userdata, Uint8 *stream, int length) {
+  struct audio_output *a = userdata;
+  struct audio_ring *r = &a->ring;
+  int16_t *out = (int16_t*)stream;
+  int wanted = length / sizeof(int16_t);
+  unsigned tail = (unsigned)SDL_AtomicGet(&r->tail);
+  int available = (unsigned)SDL_AtomicGet(&r->head) - tail;
+  int count = available < wanted ? available : wanted;
+  for(int i=0; i<count; i++)
+    out[i] = r->samples[(tail + i) & (AUDIO_RING - 1)];
+  if(count)
+    a->last = out[count-1];
+  // holding the last sample is quieter than dropping to zero
+  for(int i=count; i<wanted; i++)
+    out[i] = a->last;
+  if(count < wanted)
+    a->underruns++;
+  SDL_AtomicSet(&r->tail, (int)(tail + count));
+}
+
+// Returns 0 if sound is playing, the emulator carries on silently otherwise
+int audio_open(struct audio_output *a, struct miuchiz_hardware *hw) {
+  memset(a, 0, sizeof(*a));
+  if(SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+    printf("No audio: %s\n", SDL_GetError());
+    return -1;
+  }
+  SDL_AudioSpec want, have;
+  memset(&want, 0, sizeof(want));
+  want.freq = AUDIO_RATE;
+  want.format = AUDIO_S16SYS;
+  want.channels = 1;
+  want.samples = 512;
+  want.callback = audio_callback;
+  want.userdata = a;
+  if(!(a->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0))) {
+    printf("No audio: %s\n", SDL_GetError());
+    return -1;
+  }
+  // enough for the callback to take a buffer while the next frame's still coming
+  a->target = have.samples * 2 + AUDIO_RATE / MIUCHIZ_FRAME_RATE;
+  sound_set_rate(hw, AUDIO_RATE);
+  SDL_PauseAudioDevice(a->device, 0);
+  return 0;
+}
+
+// Moves the samples from the last miuchiz_run() into the ring, and steers
+// the rate they're made at so the ring stays about as full as it should.
+// Anything that doesn't fit, like when running faster than real time, is dropped.
+void audio_frame(struct audio_output *a, struct miuchiz_hardware *hw) {
+  if(!a->device)
+    return;
+  struct audio_ring *r = &a->ring;
+  int16_t samples[SOUND_BUFFER];
+  int count = sound_take(hw, samples, SOUND_BUFFER);
+  unsigned head = (unsigned)SDL_AtomicGet(&r->head);
+  int space = AUDIO_RING - (head - (unsigned)SDL_AtomicGet(&r->tail));
+  if(count > space)
+    count = space;
+  for(int i=0; i<count; i++)
+    r->samples[(head + i) & (AUDIO_RING - 1)] = samples[i];
+  SDL_AtomicSet(&r->head, (int)(head + count));
+
+  int fill = head + count - (unsigned)SDL_AtomicGet(&r->tail);
+  double error = (double)(a->target - fill) / a->target;
+  if(error > 1)
+    error = 1;
+  else if(error < -1)
+    error = -1;
+  sound_set_rate(hw, AUDIO_RATE * (1 + MAX_RATE_DRIFT * error));
+}
+
+void audio_close(struct audio_output *a) {
+  if(a->device)
+    SDL_CloseAudioDevice(a->device);
+  a->device = 0;
+}
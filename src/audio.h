@@ -0,0 +1,30 @@
+#ifndef MIUCHIZ_AUDIO_HEADER
+#define MIUCHIZ_AUDIO_HEADER
+#include <SDL2/SDL.h>
+#include "hardware.h"
+
+#define AUDIO_RATE 48000
+#define AUDIO_RING 8192 // samples, must be a power of two
+
+// Samples go from the emulation to SDL's audio callback through a single
+// producer, single consumer ring. Each side only writes its own index, so
+// neither ever waits on the other. The indexes wrap around after 2^32
+// samples, so they're only ever worked with as unsigned.
+struct audio_ring {
+  int16_t samples[AUDIO_RING];
+  SDL_atomic_t head; // samples ever written, only the emulation changes it
+  SDL_atomic_t tail; // samples ever read, only the callback changes it
+};
+
+struct audio_output {
+  SDL_AudioDeviceID device;
+  struct audio_ring ring;
+  int target;        // samples to keep buffered
+  int16_t last;      // repeated when the ring runs dry, the callback's own
+  uint32_t underruns; // only the callback writes it
+};
+
+int audio_open(struct audio_output *a, struct miuchiz_hardware *hw);
+void audio_frame(struct audio_output *a, struct miuchiz_hardware *hw);
+void audio_close(struct audio_output *a);
+#endif
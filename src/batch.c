@@ -0,0 +1,263 @@
+// Batch runner: runs many independent emulator instances across all cores
+#include "hardware.h"
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// instances run this many frames at a time before going back in a queue,
+// so idle workers have something to steal when others finish early
+#define SLICE_FRAMES 60
+
+struct instance {
+  char name[64];
+  char state_path[256];
+  long long frames, frames_done;
+  uint64_t host_ns;
+  int failed;
+  struct cpu_state cpu;
+  struct miuchiz_hardware hw;
+};
+
+// Each worker owns a deque of instance numbers. It takes work from the
+// bottom of its own and steals from the top of everyone else's.
+struct worker {
+  pthread_t thread;
+  int started; // thread is only set if this is
+  pthread_mutex_t lock;
+  int *items;
+  int top, bottom;
+};
+
+static struct instance *instances;
+static struct worker *workers;
+static int instance_count, worker_count;
+static const char *otp_path = "data/otp.dat", *flash_path = "data/flash.dat";
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void push_bottom(struct worker *w, int item) {
+  pthread_mutex_lock(&w->lock);
+  w->items[w->bottom++ % instance_count] = item;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static int pop_bottom(struct worker *w) {
+  int item = -1;
+  pthread_mutex_lock(&w->lock);
+  if(w->bottom > w->top)
+    item = w->items[--w->bottom % instance_count];
+  pthread_mutex_unlock(&w->lock);
+  return item;
+}
+
+static int steal_top(struct worker *w) {
+  int item = -1;
+  pthread_mutex_lock(&w->lock);
+  if(w->bottom > w->top)
+    item = w->items[w->top++ % instance_count];
+  pthread_mutex_unlock(&w->lock);
+  return item;
+}
+
+static int start_instance(struct instance *in) {
+  miuchiz_reset(&in->cpu, &in->hw);
+  if(miuchiz_load_images(&in->hw, otp_path, flash_path))
+    return -1;
+  if(in->state_path[0]) {
+    struct savestate_tracker *t = malloc(sizeof(struct savestate_tracker));
+    FILE *file = fopen(in->state_path, "rb");
+    int error = !t || !file;
+    if(!error) {
+      savestate_init(t);
+      error = savestate_load(t, &in->cpu, &in->hw, file);
+    }
+    if(file)
+      fclose(file);
+    free(t);
+    if(error)
+      return -1;
+  }
+  return 0;
+}
+
+// Runs one slice of an instance, returns 1 if it still has frames left
+static int run_slice(struct instance *in) {
+  uint64_t start = now_ns();
+  if(in->frames_done == 0 && start_instance(in)) {
+    in->failed = 1;
+    return 0;
+  }
+  for(int i = 0; i < SLICE_FRAMES && in->frames_done < in->frames; i++, in->frames_done++)
+    miuchiz_run(&in->cpu, &in->hw, MIUCHIZ_CYCLES_PER_FRAME);
+  in->host_ns += now_ns() - start;
+  return in->frames_done < in->frames;
+}
+
+// Instances only go back in the deque of the worker that ran them, so once
+// every deque is empty each unfinished instance has a worker of its own and
+// there's nothing left to steal. A worker that finds that can stop.
+static void *worker_thread(void *arg) {
+  int self = (struct worker*)arg - workers;
+  while(1) {
+    int item = pop_bottom(&workers[self]);
+    for(int i = 1; item < 0 && i < worker_count; i++)
+      item = steal_top(&workers[(self + i) % worker_count]);
+    if(item < 0)
+      break;
+    if(run_slice(&instances[item]))
+      push_bottom(&workers[self], item);
+  }
+  return NULL;
+}
+
+static int add_instance(const char *name, long long frames, const char *state_path) {
+  struct instance *grown = realloc(instances, sizeof(struct instance) * (instance_count + 1));
+  if(!grown)
+    return -1;
+  instances = grown;
+  struct instance *in = &instances[instance_count++];
+  memset(in, 0, sizeof(*in));
+  snprintf(in->name, sizeof(in->name), "%s", name);
+  snprintf(in->state_path, sizeof(in->state_path), "%s", state_path ? state_path : "");
+  in->frames = frames;
+  return 0;
+}
+
+// scenario files have one "name frames [save state]" per line, # starts a comment
+static int read_scenarios(const char *path) {
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    printf("Can't open %s\n", path);
+    return -1;
+  }
+  char line[512], name[64], state[256];
+  long long frames;
+  while(fgets(line, sizeof(line), file)) {
+    char *comment = strchr(line, '#');
+    if(comment)
+      *comment = 0;
+    int fields = sscanf(line, "%63s %lld %255s", name, &frames, state);
+    if(fields >= 2 && add_instance(name, frames, fields == 3 ? state : NULL)) {
+      puts("Not enough memory for the instances");
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-j threads] [-n instances] [-f frames] [-s scenarios] [--otp file] [--flash file]\n", name);
+  printf("  -j       worker threads (default: number of cores)\n");
+  printf("  -n       boot this many instances from reset (default 1 without -s)\n");
+  printf("  -f       frames for each -n instance (default 600)\n");
+  printf("  -s       file with one \"name frames [save state]\" scenario per line\n");
+}
+
+int main(int argc, char *argv[]) {
+  long long frames = 600;
+  int boot_count = 0;
+  const char *scenario_path = NULL;
+  worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-j") && i+1 < argc) {
+      worker_count = strtol(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "-n") && i+1 < argc) {
+      boot_count = strtol(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "-f") && i+1 < argc) {
+      frames = strtoll(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "-s") && i+1 < argc) {
+      scenario_path = argv[++i];
+    } else if(!strcmp(argv[i], "--otp") && i+1 < argc) {
+      otp_path = argv[++i];
+    } else if(!strcmp(argv[i], "--flash") && i+1 < argc) {
+      flash_path = argv[++i];
+    } else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if(worker_count < 1)
+    worker_count = 1;
+  if(!scenario_path && !boot_count)
+    boot_count = 1;
+
+  if(scenario_path && read_scenarios(scenario_path))
+    return -1;
+  for(int i = 0; i < boot_count; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "boot%d", i);
+    if(add_instance(name, frames, NULL)) {
+      puts("Not enough memory for the instances");
+      return -1;
+    }
+  }
+  if(!instance_count) {
+    puts("No instances to run");
+    return -1;
+  }
+
+  // deal the instances out round robin, stealing evens out the rest
+  workers = calloc(worker_count, sizeof(struct worker));
+  if(!workers) {
+    puts("Not enough memory for the workers");
+    return -1;
+  }
+  for(int i = 0; i < worker_count; i++) {
+    pthread_mutex_init(&workers[i].lock, NULL);
+    workers[i].items = malloc(sizeof(int) * instance_count);
+    if(!workers[i].items) {
+      puts("Not enough memory for the workers");
+      return -1;
+    }
+  }
+  for(int i = 0; i < instance_count; i++)
+    push_bottom(&workers[i % worker_count], i);
+
+  // a worker that doesn't start leaves its deque for the others to steal,
+  // and if none start this thread does all the work itself
+  uint64_t start = now_ns();
+  int started = 0;
+  for(int i = 0; i < worker_count; i++) {
+    workers[i].started = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) == 0;
+    if(!workers[i].started)
+      printf("Can't start worker thread %d\n", i);
+    started += workers[i].started;
+  }
+  if(!started)
+    worker_thread(&workers[0]);
+  for(int i = 0; i < worker_count; i++)
+    if(workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+  uint64_t elapsed = now_ns() - start;
+
+  int failures = 0;
+  long long total_frames = 0;
+  printf("%-16s %8s %16s %2s %2s %2s %2s %2s %4s %9s\n", "name", "frames", "pixel hash", "A", "X", "Y", "S", "P", "PC", "host ms");
+  for(int i = 0; i < instance_count; i++) {
+    struct instance *in = &instances[i];
+    if(in->failed) {
+      printf("%-16s failed to start\n", in->name);
+      failures++;
+      continue;
+    }
+    total_frames += in->frames_done;
+    printf("%-16s %8lld %016llx %02x %02x %02x %02x %02x %04x %9.1f\n", in->name, in->frames_done,
+      (unsigned long long)miuchiz_pixel_hash(&in->hw), in->cpu.a, in->cpu.x, in->cpu.y, in->cpu.s,
+      cpu_get_flags(&in->cpu), in->cpu.pc, in->host_ns / 1e6);
+    miuchiz_unload_images(&in->hw);
+  }
+  printf("%d instances, %d threads, %.3f s, %.1f frames/sec total\n", instance_count, worker_count,
+    elapsed / 1e9, total_frames * 1e9 / (elapsed ? elapsed : 1));
+  return failures ? 1 : 0;
+}
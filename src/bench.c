@@ -0,0 +1,338 @@
+// Headless benchmark: runs the core without SDL as fast as the host allows
+#include "hardware.h"
+#include "savestate.h"
+#include "profiler.h"
+#include "trace.h"
+#include "debugger.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct cpu_state cpu;
+struct miuchiz_hardware hw;
+struct savestate_tracker savestates;
+#ifdef MIUCHIZ_PROFILER
+struct profiler profiler;
+#endif
+struct trace_buffer trace;
+struct debugger debugger;
+static const char *trace_path = NULL;
+
+// Best effort, so a crash in the core still leaves the last instructions behind
+static void crash_handler(int sig) {
+  signal(sig, SIG_DFL);
+  trace_dump(&trace, trace_path);
+  raise(sig);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-f frames] [-i instructions] [--otp file] [--flash file]\n", name);
+  printf("  -f       number of frames to run (default 600)\n");
+  printf("  -i       run frames until this many instructions have run\n");
+  printf("  --otp    OTP image (default data/otp.dat)\n");
+  printf("  --flash  flash image (default data/flash.dat)\n");
+  printf("  --load-state file       load a save state first, can be repeated to apply deltas\n");
+  printf("  --checkpoint n prefix   save a state every n frames, a keyframe and then deltas\n");
+  printf("  --no-idle-skip          run polling loops instead of fast-forwarding them\n");
+  printf("  --no-block-cache        interpret all code instead of predecoding OTP and flash\n");
+  printf("  --break region:offset   stop at this physical address, like flash:008256\n");
+  printf("  --watch r|w|rw region:start[-end]  stop after an access to these physical addresses\n");
+  printf("  --trace n file          keep the last n instructions and write them to file at exit\n");
+  printf("  --check-state file      check that every truncated copy of a save state fails to load\n");
+  printf("                          and leaves the machine alone, then exit\n");
+#ifdef MIUCHIZ_PROFILER
+  printf("  --profile prefix        write prefix.txt and prefix.folded with a profile\n");
+#endif
+}
+
+// The whole machine as a keyframe, for telling whether anything changed
+static long snapshot(FILE *file) {
+  static struct savestate_tracker scratch;
+  savestate_init(&scratch);
+  rewind(file);
+  savestate_save(&scratch, &cpu, &hw, file, 0);
+  return ftell(file);
+}
+
+// Loads every prefix of data, which must all fail without touching the
+// machine, and then the whole thing, which must work. expected is the
+// machine as snapshot() wrote it to before.
+static int check_prefixes(const char *path, const uint8_t *data, long size, FILE *after, FILE *cut,
+                          const uint8_t *expected, uint8_t *got, long before_size) {
+  // every length through the header and the end, and a spread in between
+  int checked = 0, failures = 0;
+  for(long length = 0; length < size; length += (length < 64 || length >= size - 300) ? 1 : 97) {
+    struct savestate_tracker tracker = savestates;
+    rewind(cut);
+    if(ftruncate(fileno(cut), 0)) {
+      puts("Can't truncate a temporary file");
+      return -1;
+    }
+    fwrite(data, 1, length, cut);
+    fflush(cut);
+    rewind(cut);
+    int loaded = savestate_load(&tracker, &cpu, &hw, cut) == 0;
+    long after_size = snapshot(after);
+    rewind(after);
+    int same = after_size == before_size && fread(got, 1, after_size, after) == (size_t)after_size
+      && !memcmp(got, expected, after_size);
+    if(loaded || !same) {
+      printf("%ld bytes of %ld %s\n", length, size, loaded ? "loaded" : "changed the machine");
+      failures++;
+    }
+    checked++;
+  }
+  rewind(cut);
+  if(ftruncate(fileno(cut), 0)) {
+    puts("Can't truncate a temporary file");
+    return -1;
+  }
+  fwrite(data, 1, size, cut);
+  fflush(cut);
+  rewind(cut);
+  if(savestate_load(&savestates, &cpu, &hw, cut)) {
+    printf("%s doesn't load whole\n", path);
+    failures++;
+  }
+  printf("checked %d truncated copies of %s, %d failures\n", checked, path, failures);
+  return failures ? -1 : 0;
+}
+
+// Sets up for check_prefixes() and cleans up after it, however it goes
+static int check_state(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if(!file) {
+    printf("Can't open %s\n", path);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  uint8_t *data = malloc(size > 0 ? size : 1);
+  rewind(file);
+  int loaded = data && size > 0 && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  FILE *before = tmpfile(), *after = tmpfile(), *cut = tmpfile();
+  long before_size = before ? snapshot(before) : 0;
+  uint8_t *expected = malloc(before_size > 0 ? before_size : 1), *got = malloc(before_size > 0 ? before_size : 1);
+  int result = -1;
+  if(!loaded) {
+    printf("Can't read %s\n", path);
+  } else if(!before || !after || !cut) {
+    puts("Can't make temporary files");
+  } else {
+    rewind(before);
+    if(!expected || !got || fread(expected, 1, before_size, before) != (size_t)before_size)
+      puts("Can't read back the machine's state");
+    else
+      result = check_prefixes(path, data, size, after, cut, expected, got, before_size);
+  }
+
+  if(before)
+    fclose(before);
+  if(after)
+    fclose(after);
+  if(cut)
+    fclose(cut);
+  free(expected);
+  free(got);
+  free(data);
+  return result;
+}
+
+static long long checkpoint_bytes = 0;
+static uint64_t checkpoint_ns = 0;
+
+static void checkpoint(const char *prefix, int number) {
+  uint64_t start = now_ns();
+  char path[1024];
+  snprintf(path, sizeof(path), "%s-%06d.sav", prefix, number);
+  FILE *file = fopen(path, "wb");
+  if(!file) {
+    printf("Can't open %s for writing\n", path);
+    exit(-1);
+  }
+  savestate_save(&savestates, &cpu, &hw, file, 1);
+  checkpoint_bytes += ftell(file);
+  fclose(file);
+  checkpoint_ns += now_ns() - start;
+}
+
+int main(int argc, char *argv[]) {
+  long long frames = 600, instructions = 0, checkpoint_every = 0;
+  int skip_idle = 1, block_cache = 1;
+  long long trace_length = 0;
+  const char *checkpoint_prefix = NULL, *check_path = NULL;
+#ifdef MIUCHIZ_PROFILER
+  const char *profile_prefix = NULL;
+#endif
+  const char *otp_path = "data/otp.dat", *flash_path = "data/flash.dat";
+
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-f") && i+1 < argc) {
+      frames = strtoll(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "-i") && i+1 < argc) {
+      instructions = strtoll(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "--otp") && i+1 < argc) {
+      otp_path = argv[++i];
+    } else if(!strcmp(argv[i], "--flash") && i+1 < argc) {
+      flash_path = argv[++i];
+    } else if(!strcmp(argv[i], "--load-state") && i+1 < argc) {
+      i++; // loaded once the images are in
+    } else if(!strcmp(argv[i], "--checkpoint") && i+2 < argc) {
+      checkpoint_every = strtoll(argv[++i], NULL, 0);
+      checkpoint_prefix = argv[++i];
+    } else if(!strcmp(argv[i], "--no-idle-skip")) {
+      skip_idle = 0;
+    } else if(!strcmp(argv[i], "--trace") && i+2 < argc) {
+      trace_length = strtoll(argv[++i], NULL, 0);
+      trace_path = argv[++i];
+    } else if(!strcmp(argv[i], "--break") && i+1 < argc) {
+      i++;
+    } else if(!strcmp(argv[i], "--watch") && i+2 < argc) {
+      i += 2;
+    } else if(!strcmp(argv[i], "--no-block-cache")) {
+      block_cache = 0;
+    } else if(!strcmp(argv[i], "--check-state") && i+1 < argc) {
+      check_path = argv[++i];
+#ifdef MIUCHIZ_PROFILER
+    } else if(!strcmp(argv[i], "--profile") && i+1 < argc) {
+      profile_prefix = argv[++i];
+#endif
+    } else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  miuchiz_reset(&cpu, &hw);
+  int error = miuchiz_load_images(&hw, otp_path, flash_path);
+  if(error == MIUCHIZ_BAD_OTP)
+    printf("Can't load OTP: %s, it has to be %d bytes\n", otp_path, MIUCHIZ_OTP_SIZE);
+  else if(error)
+    printf("Can't load flash: %s, it has to be %d bytes\n", flash_path, MIUCHIZ_FLASH_SIZE);
+  if(error)
+    return -1;
+  debugger_init(&debugger, &cpu, &hw);
+  savestate_init(&savestates);
+  cpu.skip_idle = skip_idle;
+  if(!block_cache)
+    cpu.code_map = NULL;
+#ifdef MIUCHIZ_PROFILER
+  if(profile_prefix) {
+    if(profiler_init(&profiler, &hw)) {
+      puts("Not enough memory for the profiler");
+      return -1;
+    }
+    cpu.profiler = &profiler;
+  }
+#endif
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "--load-state")) {
+      FILE *file = fopen(argv[++i], "rb");
+      if(!file || savestate_load(&savestates, &cpu, &hw, file)) {
+        printf("Can't load %s\n", argv[i]);
+        return -1;
+      }
+      fclose(file);
+    } else if(!strcmp(argv[i], "--break")) {
+      uint32_t address;
+      if(debugger_parse_address(argv[++i], &address) || debugger_add_breakpoint(&debugger, address)) {
+        printf("Bad breakpoint %s\n", argv[i]);
+        return -1;
+      }
+    } else if(!strcmp(argv[i], "--watch")) {
+      const char *kind = argv[++i];
+      uint32_t start, end;
+      int flags = (strchr(kind, 'r') ? WATCH_READ : 0) | (strchr(kind, 'w') ? WATCH_WRITE : 0);
+      if(!flags || debugger_parse_range(argv[++i], &start, &end) || debugger_add_watchpoint(&debugger, start, end, flags)) {
+        printf("Bad watchpoint %s %s\n", kind, argv[i]);
+        return -1;
+      }
+    }
+  }
+  if(check_path)
+    return check_state(check_path) ? -1 : 0;
+  if(trace_length > 0) {
+    if(trace_init(&trace, trace_length)) {
+      puts("Not enough memory for the trace");
+      return -1;
+    }
+    trace_start(&trace, &cpu, &hw);
+    signal(SIGSEGV, crash_handler);
+    signal(SIGABRT, crash_handler);
+  }
+
+  uint64_t start = now_ns();
+  uint64_t start_time = current_time(&hw);
+  long long executed = 0;
+  if(instructions > 0) {
+    // whole frames at a time, giving up after a second with nothing run
+    long long idle = 0;
+    frames = 0;
+    while(executed < instructions && idle < MIUCHIZ_FRAME_RATE && !debugger.hit) {
+      int ran = miuchiz_run(&cpu, &hw, MIUCHIZ_CYCLES_PER_FRAME);
+      idle = ran ? 0 : idle + 1;
+      executed += ran;
+      frames++;
+    }
+  } else {
+    for(long long frame = 0; frame < frames && !debugger.hit; frame++) {
+      executed += miuchiz_run(&cpu, &hw, MIUCHIZ_CYCLES_PER_FRAME);
+      if(checkpoint_every > 0 && (frame + 1) % checkpoint_every == 0)
+        checkpoint(checkpoint_prefix, (frame + 1) / checkpoint_every - 1);
+    }
+  }
+  long long cycles = current_time(&hw) - start_time;
+  uint64_t elapsed = now_ns() - start;
+  if(!elapsed)
+    elapsed = 1;
+
+  printf("instructions:     %lld\n", executed);
+  printf("cycles:           %lld\n", cycles);
+  printf("frames:           %lld\n", frames);
+  printf("elapsed:          %.3f s\n", elapsed / 1e9);
+  printf("instructions/sec: %.0f\n", executed * 1e9 / elapsed);
+  printf("frames/sec:       %.1f\n", frames * 1e9 / elapsed);
+  printf("ns/frame:         %.0f\n", (double)elapsed / (frames ? frames : 1));
+  printf("speed:            %.2fx real time\n", (double)cycles / MIUCHIZ_CPU_CLOCK * 1e9 / elapsed);
+  if(checkpoint_prefix) {
+    long long count = checkpoint_every > 0 ? frames / checkpoint_every : 0;
+    printf("checkpoints:      %lld, %lld bytes, %.3f ms each\n", count, checkpoint_bytes,
+      count ? checkpoint_ns / 1e6 / count : 0.0);
+  }
+  for(int i=0; i<IDLE_LOOP_SLOTS; i++) {
+    struct idle_loop *loop = &cpu.idle_loops[i];
+    if(loop->skips)
+      printf("idle loop:        %.4x-%.4x, %d cycles, %llu skips, %.1f%% of cycles\n", loop->start, loop->end - 1,
+        loop->cycles, (unsigned long long)loop->skips, loop->skipped * 100.0 / (cycles ? cycles : 1));
+  }
+  printf("pixel hash:       %016llx\n", (unsigned long long)miuchiz_pixel_hash(&hw));
+  if(debugger.hit) {
+    char text[128];
+    debugger_describe_hit(&debugger, text, sizeof(text));
+    printf("stopped:          %s at cycle %llu\n", text, (unsigned long long)current_time(&hw));
+    printf("registers:        A:%.2x X:%.2x Y:%.2x S:%.2x P:%.2x PC:%.4x\n", cpu.a, cpu.x, cpu.y, cpu.s, cpu_get_flags(&cpu), cpu.pc);
+  }
+#ifdef MIUCHIZ_PROFILER
+  if(profile_prefix) {
+    profiler_write(&profiler, profile_prefix);
+    profiler_free(&profiler);
+  }
+#endif
+  if(trace_length > 0) {
+    trace_dump(&trace, trace_path);
+    trace_free(&trace);
+  }
+  miuchiz_unload_images(&hw);
+  return 0;
+}
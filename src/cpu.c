@@ -1,691 +1,638 @@
-#include "miuchiz.h"
+#include "hardware.h"
+#include "profiler.h"
+#include "trace.h"
+#include "debugger.h"
 // https://www.dropbox.com/s/nmf2b9am4p6ptr6/cpu6502.py?dl=0 used as a guide
 
-#define FLAG_CARRY    1
-#define FLAG_ZERO     2
-#define FLAG_NO_IRQ   4
-#define FLAG_DECIMAL  8
-#define FLAG_OVERFLOW 64
-#define FLAG_NEGATIVE 128
-
-typedef uint16_t (*address_mode)(struct cpu_state *s);
-typedef void (*memory_op)(struct cpu_state *s, uint8_t value);
+typedef void (*opcode_handler)(struct cpu_state *s);
 
 // ------------------------------------------------------------------
 
-uint8_t get_instruction_byte(struct cpu_state *s) {
-  return s->read(s->hardware, s->pc++);
-}
-
-uint16_t zeropage(struct cpu_state *s) {
-  return get_instruction_byte(s);
-}
-
-uint16_t zeropage_x(struct cpu_state *s) {
-  return (get_instruction_byte(s) + s->x) & 0xff;
-}
-
-uint16_t zeropage_y(struct cpu_state *s) {
-  return (get_instruction_byte(s) + s->y) & 0xff;
+// operands are fetched ahead of time, by run_instruction() or from a block
+static inline uint8_t get_instruction_byte(struct cpu_state *s) {
+  s->pc++;
+  return *s->operand++;
 }
 
-uint16_t absolute(struct cpu_state *s) {
-  uint8_t low = get_instruction_byte(s);
-  uint8_t high = get_instruction_byte(s);
-  return (high << 8) | low;
+// indexed reads take an extra cycle when the index carries into the high byte
+static inline uint16_t page_cross(struct cpu_state *s, uint16_t base, uint16_t address) {
+  if((base ^ address) & 0xff00)
+    s->cycles++;
+  return address;
 }
 
-uint16_t absolute_x(struct cpu_state *s) {
-  uint8_t low = get_instruction_byte(s);
-  uint8_t high = get_instruction_byte(s);
-  return ((high << 8) | low) + s->x;
+static inline int sign_extend(uint8_t t) {
+  if(t & 0x80)
+    return t | ~0xff;
+  return t;
 }
 
-uint16_t absolute_y(struct cpu_state *s) {
-  uint8_t low = get_instruction_byte(s);
-  uint8_t high = get_instruction_byte(s);
-  return ((high << 8) | low) + s->y;
+// loops longer than this aren't checked to see if they're idle
+#define IDLE_LOOP_BYTES 16
+static void idle_loop_check(struct cpu_state *s, uint16_t target);
+
+// taken branches cost one cycle, or two if they land on another page
+static inline void branch(struct cpu_state *s, uint8_t amount) {
+  uint16_t target = s->pc + sign_extend(amount);
+  s->cycles += ((s->pc ^ target) & 0xff00) ? 2 : 1;
+  if(s->skip_idle && target < s->pc && s->pc - target <= IDLE_LOOP_BYTES)
+    idle_loop_check(s, target);
+  s->pc = target;
 }
 
-uint16_t indirect(struct cpu_state *s) {
-  uint8_t zp = get_instruction_byte(s);
-  uint8_t low = s->read(s->hardware, zp);
-  uint8_t high = s->read(s->hardware, zp+1);
-  return ((high << 8) | low);
-}
+// ------------------------------------------------------------------
 
-uint16_t indirect_x(struct cpu_state *s) {
-  uint8_t zp = get_instruction_byte(s);
-  uint8_t low = s->read(s->hardware, (zp+s->x)&0xff);
-  uint8_t high = s->read(s->hardware, (zp+s->x+1)&0xff);
-  return ((high << 8) | low);
+// N, Z, C and V are only worked out from these when something reads them,
+// see cpu_get_flags()
+static inline int flag_negative(struct cpu_state *s) {
+  return s->nz & 0x180;
 }
 
-uint16_t indirect_y(struct cpu_state *s) {
-  uint8_t zp = get_instruction_byte(s);
-  uint8_t low = s->read(s->hardware, zp);
-  uint8_t high = s->read(s->hardware, zp+1);
-  return ((high << 8) | low) + s->y;
+static inline int flag_zero(struct cpu_state *s) {
+  return !(s->nz & 0xff);
 }
 
-void push(struct cpu_state *s, uint8_t value) {
-  s->write(s->hardware, 0x100+(s->s--), value);
+static inline void update_nz(struct cpu_state *s, uint8_t value) {
+  s->nz = value;
 }
 
-uint8_t pop(struct cpu_state *s) {
-  return s->read(s->hardware, 0x100+(++s->s));
+// sets Z from value and leaves N alone
+static inline void update_z(struct cpu_state *s, uint8_t value) {
+  s->nz = (flag_negative(s) ? 0x100 : 0) | (value != 0);
 }
 
-int sign_extend(uint8_t t) {
-  if(t & 0x80)
-    return t | ~0xff;
-  return t;
+static inline void op_ora(struct cpu_state *s, uint8_t value) {
+  s->a |= value;
+  update_nz(s, s->a);
 }
 
-void branch(struct cpu_state *s, uint8_t amount) {
-  s->pc += sign_extend(amount);
+static inline void op_and(struct cpu_state *s, uint8_t value) {
+  s->a &= value;
+  update_nz(s, s->a);
 }
 
-// ------------------------------------------------------------------
-
-void update_z(struct cpu_state *s, uint8_t value) {
-  s->flags &= ~(FLAG_ZERO);
-  if(value == 0)
-    s->flags |= FLAG_ZERO;
+static inline void op_eor(struct cpu_state *s, uint8_t value) {
+  s->a ^= value;
+  update_nz(s, s->a);
 }
 
-void update_nz(struct cpu_state *s, uint8_t value) {
-  s->flags &= ~(FLAG_ZERO | FLAG_NEGATIVE);
-  if(value == 0)
-    s->flags |= FLAG_ZERO;
-  if(value & 128)
-    s->flags |= FLAG_NEGATIVE;
+// Decimal mode results for every A, operand and carry, as the result in the
+// low byte, C in bit 8 and V in bit 15. Bytes that aren't BCD give what
+// the 65C02 gives.
+#define DECIMAL_CARRY    0x0100
+#define DECIMAL_OVERFLOW 0x8000
+static uint16_t decimal_adc[2][256][256], decimal_sbc[2][256][256];
+
+static void __attribute__((constructor)) build_decimal_tables(void) {
+  for(int carry = 0; carry < 2; carry++) {
+    for(int a = 0; a < 256; a++) {
+      for(int value = 0; value < 256; value++) {
+        int low = (a & 0x0f) + (value & 0x0f) + carry;
+        if(low > 9)
+          low = ((low + 6) & 0x0f) + 0x10;
+        int result = (a & 0xf0) + (value & 0xf0) + low;
+        // V comes from the sum before the high digit is adjusted
+        int twos = (int8_t)(a & 0xf0) + (int8_t)(value & 0xf0) + low;
+        if(result >= 0xa0)
+          result += 0x60;
+        decimal_adc[carry][a][value] = (result & 0xff) | (result > 0xff ? DECIMAL_CARRY : 0) |
+          (twos < -128 || twos > 127 ? DECIMAL_OVERFLOW : 0);
+
+        // subtracting sets C and V the same as in binary
+        low = (a & 0x0f) - (value & 0x0f) + carry - 1;
+        result = a - value + carry - 1;
+        twos = (int8_t)a - (int8_t)value + carry - 1;
+        int borrow = result < 0;
+        if(result < 0)
+          result -= 0x60;
+        if(low < 0)
+          result -= 0x06;
+        decimal_sbc[carry][a][value] = (result & 0xff) | (borrow ? 0 : DECIMAL_CARRY) |
+          (twos < -128 || twos > 127 ? DECIMAL_OVERFLOW : 0);
+      }
+    }
+  }
 }
 
-void op_ora(struct cpu_state *s, uint8_t value) {
-  s->a |= value;
+// decimal mode takes an extra cycle on the 65C02
+static inline void decimal_result(struct cpu_state *s, uint16_t result) {
+  s->cycles++;
+  s->a = result;
+  s->carry = (result >> 8) & 1;
+  s->overflow = result >> 8;
   update_nz(s, s->a);
 }
 
-void op_and(struct cpu_state *s, uint8_t value) {
-  s->a &= value;
+static inline void binary_adc(struct cpu_state *s, uint8_t value) {
+  unsigned sum = s->a + value + s->carry;
+  // V when both inputs have the same sign and the result doesn't
+  s->overflow = (s->a ^ sum) & (value ^ sum);
+  s->carry = sum >> 8;
+  s->a = sum;
   update_nz(s, s->a);
 }
 
-void op_eor(struct cpu_state *s, uint8_t value) {
-  s->a ^= value;
-  update_nz(s, s->a);
+static inline void op_adc(struct cpu_state *s, uint8_t value) {
+  if(s->flags & FLAG_DECIMAL)
+    decimal_result(s, decimal_adc[s->carry][s->a][value]);
+  else
+    binary_adc(s, value);
 }
 
-void op_adc(struct cpu_state *s, uint8_t value) {
-  int carry = (s->flags & FLAG_CARRY)?1:0;
-  if(s->flags & FLAG_DECIMAL) {
-    int lowresult = (s->a & 0x0F) + (value & 0x0F) + carry;
-    if(lowresult > 9)
-      lowresult = ((lowresult + 6) & 0xF)+16;
-    int result = (s->a & 0xF0) + (value & 0xF0) + lowresult;
-    if(result >= 0xa0)
-      result += 0x60;
-
-     s->flags &= ~(FLAG_CARRY | FLAG_OVERFLOW);
-     if(result > 255)
-       s->flags |= FLAG_CARRY;
-     int twos = sign_extend(value & 0xf0) + sign_extend(s->a & 0xf0) + lowresult;
-    
-     value = result & 0xff;
-
-     if(twos < -128 || twos > 127)
-       s->flags |= FLAG_OVERFLOW;
-  } else {
-     int twos = sign_extend(value) + sign_extend(s->a) + carry;
-     int result = value = s->a + carry;
-     s->flags &= ~(FLAG_CARRY | FLAG_OVERFLOW);
-     if(result > 255)
-       s->flags |= FLAG_CARRY;
-
-     value = result & 0xff;
-
-     if(twos < -128 || twos > 127)
-       s->flags |= FLAG_OVERFLOW;
-  }
-
-  s->a = value;
-  update_nz(s, s->a);
+static inline void op_sbc(struct cpu_state *s, uint8_t value) {
+  if(s->flags & FLAG_DECIMAL)
+    decimal_result(s, decimal_sbc[s->carry][s->a][value]);
+  else
+    binary_adc(s, value ^ 255);
 }
 
-void op_lda(struct cpu_state *s, uint8_t value) {
+static inline void op_lda(struct cpu_state *s, uint8_t value) {
   s->a = value;
   update_nz(s, s->a);
 }
 
-void op_ldx(struct cpu_state *s, uint8_t value) {
+static inline void op_ldx(struct cpu_state *s, uint8_t value) {
   s->x = value;
   update_nz(s, s->x);
 }
 
-void op_ldy(struct cpu_state *s, uint8_t value) {
+static inline void op_ldy(struct cpu_state *s, uint8_t value) {
   s->y = value;
   update_nz(s, s->y);
 }
 
-void op_bit(struct cpu_state *s, uint8_t value) {
-  s->flags &= ~(FLAG_ZERO | FLAG_NEGATIVE | FLAG_OVERFLOW);
-  if(value & 128)
-    s->flags |= FLAG_NEGATIVE;
-  if(value & 64)
-    s->flags |= FLAG_OVERFLOW;
-  if((s->a & value) == 0)
-    s->flags |= FLAG_ZERO;
+static inline void op_bit(struct cpu_state *s, uint8_t value) {
+  s->nz = ((s->a & value) != 0) | ((value & 0x80) << 1);
+  s->overflow = value << 1;
 }
 
+// bit immediate only affects Z on the 65C02
+static inline void op_bit_imm(struct cpu_state *s, uint8_t value) {
+  update_z(s, s->a & value);
+}
 
-void compare(struct cpu_state *s, uint8_t reg, uint8_t value) {
-  s->flags &= ~(FLAG_ZERO | FLAG_NEGATIVE | FLAG_CARRY);
-  if(reg == value) 
-    s->flags |= FLAG_ZERO;
-  if(reg >= value) 
-    s->flags |= FLAG_CARRY;
-  if((reg - value) & 0x80) 
-    s->flags |= FLAG_NEGATIVE;
+static inline void compare(struct cpu_state *s, uint8_t reg, uint8_t value) {
+  update_nz(s, reg - value);
+  s->carry = reg >= value;
 }
 
-void op_cmp(struct cpu_state *s, uint8_t value) {
+static inline void op_cmp(struct cpu_state *s, uint8_t value) {
   compare(s, s->a, value);
 }
 
-void op_cpx(struct cpu_state *s, uint8_t value) {
+static inline void op_cpx(struct cpu_state *s, uint8_t value) {
   compare(s, s->x, value);
 }
 
-void op_cpy(struct cpu_state *s, uint8_t value) {
+static inline void op_cpy(struct cpu_state *s, uint8_t value) {
   compare(s, s->y, value);
 }
 
-void op_sbc(struct cpu_state *s, uint8_t value) {
-  // maybe decimal mode is different?
-  op_adc(s, value ^ 255);
+// read-modify-write operations return the new value
+
+static inline uint8_t op_asl(struct cpu_state *s, uint8_t value) {
+  s->carry = value >> 7;
+  value <<= 1;
+  update_nz(s, value);
+  return value;
+}
+
+static inline uint8_t op_rol(struct cpu_state *s, uint8_t value) {
+  uint8_t result = (value << 1) | s->carry;
+  s->carry = value >> 7;
+  update_nz(s, result);
+  return result;
+}
+
+static inline uint8_t op_lsr(struct cpu_state *s, uint8_t value) {
+  s->carry = value & 1;
+  value >>= 1;
+  update_nz(s, value);
+  return value;
 }
 
+static inline uint8_t op_ror(struct cpu_state *s, uint8_t value) {
+  uint8_t result = (value >> 1) | (s->carry << 7);
+  s->carry = value & 1;
+  update_nz(s, result);
+  return result;
+}
+
+static inline uint8_t op_inc(struct cpu_state *s, uint8_t value) {
+  value++;
+  update_nz(s, value);
+  return value;
+}
+
+static inline uint8_t op_dec(struct cpu_state *s, uint8_t value) {
+  value--;
+  update_nz(s, value);
+  return value;
+}
+
+static inline uint8_t op_tsb(struct cpu_state *s, uint8_t value) {
+  update_z(s, s->a & value);
+  return value | s->a;
+}
+
+static inline uint8_t op_trb(struct cpu_state *s, uint8_t value) {
+  update_z(s, s->a & value);
+  return value & ~s->a;
+}
 
 // ------------------------------------------------------------------
+// One handler per opcode, defined by cpu_core.h with these. Addressing
+// modes and operations are all inline, so each handler ends up as a single
+// straight-line function.
 
-void run_instruction(struct cpu_state *s) {
-  if(s->waiting)
-    return;
-  uint8_t opcode = get_instruction_byte(s);
-//  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%.2x PC:%.4x A:%.2x X:%.2x Y:%.2x", opcode, s->pc, s->a, s->x, s->y);
-
-  // decode the instruction
-  int aaa = opcode >> 5;
-  int bbb = (opcode >> 2) & 7;
-  int cc = opcode & 3;
-  uint8_t value = 0;
-  uint16_t address = 0;
-  int temp;
-
-  static const memory_op main_ops[] = {
-     op_ora, op_and, op_eor, op_adc, NULL, op_lda, op_cmp, op_sbc
-  };
-
-  // try instructions that don't fit the regular patterns first
-  switch(opcode) {
+#define READ_OP(name, mode, op) \
+  static void CORE(name)(struct cpu_state *s) { \
+    op(s, BUS_READ(s, CORE(mode)(s))); \
+  }
 
-    case 0xcb: // wait
-      s->waiting = 1;
-      return;
-
-    case 0x04: // tsb zp
-      address = zeropage(s);
-      temp = s->read(s->hardware, address);
-      update_z(s, s->a & temp);
-      s->write(s->hardware, address, temp | s->a);
-      return;
-    case 0x14: // trb zp
-      address = zeropage(s);
-      temp = s->read(s->hardware, address);
-      update_z(s, s->a & temp);
-      s->write(s->hardware, address, temp & ~s->a);
-      return;
-    case 0x0c: // tsb abs
-      address = absolute(s);
-      temp = s->read(s->hardware, address);
-      update_z(s, s->a & temp);
-      s->write(s->hardware, address, temp | s->a);
-      return;
-    case 0x1c: // trb abs
-      address = absolute(s);
-      temp = s->read(s->hardware, address);
-      update_z(s, s->a & temp);
-      s->write(s->hardware, address, temp & ~s->a);
-      return;
-
-    case 0x64: // stz zp
-      s->write(s->hardware, zeropage(s), 0);
-      return;
-    case 0x74: // stz zp,x
-      s->write(s->hardware, zeropage_x(s), 0);
-      return;
-    case 0x9c: // stz abs
-      s->write(s->hardware, absolute(s), 0);
-      return;
-    case 0x9e: // stz abs,x
-      s->write(s->hardware, absolute_x(s), 0);
-      return;
-
-
-    case 0x84: // sty zp
-      s->write(s->hardware, zeropage(s), s->y);
-      return;
-    case 0x94: // sty zp,x
-      s->write(s->hardware, zeropage_x(s), s->y);
-      return;
-    case 0x8c: // sty abs
-      s->write(s->hardware, absolute(s), s->y);
-      return;
-
-    case 0xac: // ldy abs
-      op_ldy(s, s->read(s->hardware, absolute(s)));
-      return;
-    case 0xbc: // ldy abs,x
-      op_ldy(s, s->read(s->hardware, absolute_x(s)));
-      return;
-
-
-    case 0xa4: // ldy zp
-      op_ldy(s, s->read(s->hardware, zeropage(s)));
-      return;
-    case 0xb4: // ldy zp,x
-      op_ldy(s, s->read(s->hardware, zeropage_x(s)));
-      return;
-    case 0xc4: // cpy zp
-      op_cpy(s, s->read(s->hardware, zeropage(s)));
-      return;
-    case 0xe4: // cpx zp
-      op_cpx(s, s->read(s->hardware, zeropage(s)));
-      return;
-
-    case 0xcc: // cpy abs
-      op_cpy(s, s->read(s->hardware, absolute(s)));
-      return;
-    case 0xec: // cpx abs
-      op_cpx(s, s->read(s->hardware, absolute(s)));
-      return;
-
-
-    case 0x10: // bpl
-      temp = get_instruction_byte(s);
-      if(!(s->flags & FLAG_NEGATIVE))
-        branch(s, temp);
-      return;
-    case 0x30: // bmi
-      temp = get_instruction_byte(s);
-      if(s->flags & FLAG_NEGATIVE)
-        branch(s, temp);
-      return;
-    case 0x50: // bvc
-      temp = get_instruction_byte(s);
-      if(!(s->flags & FLAG_OVERFLOW))
-        branch(s, temp);
-      return;
-    case 0x70: // bvs
-      temp = get_instruction_byte(s);
-      if(s->flags & FLAG_OVERFLOW)
-        branch(s, temp);
-      return;
-    case 0x90: // bcc
-      temp = get_instruction_byte(s);
-      if(!(s->flags & FLAG_CARRY))
-        branch(s, temp);
-      return;
-    case 0xB0: // bcs
-      temp = get_instruction_byte(s);
-      if(s->flags & FLAG_CARRY)
-        branch(s, temp);
-      return;
-    case 0xD0: // bne
-      temp = get_instruction_byte(s);
-      if(!(s->flags & FLAG_ZERO))
-        branch(s, temp);
-      return;
-    case 0xF0: // beq
-      temp = get_instruction_byte(s);
-      if(s->flags & FLAG_ZERO)
-        branch(s, temp);
-      return;
-    case 0x80: // bra
-      branch(s, get_instruction_byte(s));
-      return;
-
-    case 0x4c: // jmp
-      temp = get_instruction_byte(s);
-      temp = (get_instruction_byte(s)<<8) | temp;
-      s->pc = temp;
-      return;
-    case 0x6c: // jmp indirect
-      temp = get_instruction_byte(s);
-      temp = (get_instruction_byte(s)<<8) | temp;
-      address = s->read(s->hardware, temp);
-      address = (s->read(s->hardware, temp+1)<<8) | address;
-      s->pc = temp;
-      return;
-    case 0x7c: // jmp indirect indexed
-      temp = get_instruction_byte(s);
-      temp = (get_instruction_byte(s)<<8) | temp;
-      address = s->read(s->hardware, temp+s->x);
-      address = (s->read(s->hardware, temp+1+s->x)<<8) | address;
-      s->pc = temp;
-      return;
-
-    case 0x20: // jsr
-      temp = get_instruction_byte(s);
-      temp = (get_instruction_byte(s)<<8) | temp;
-      push(s, (s->pc-1)>>8);  // high
-      push(s, (s->pc-1)&255); // low
-      s->pc = temp;
-      return;
-    case 0x40: // rti
-      s->flags = pop(s);
-      temp = pop(s);
-      temp = (pop(s)<<8) | temp;
-      s->pc = temp;
-      return;
-
-
-    case 0x60: // rts
-      temp = pop(s);
-      temp = (pop(s)<<8) | temp;
-      s->pc = temp+1;
-      return;
-
-    case 0xA0: // ldy imm
-      op_ldy(s, get_instruction_byte(s));
-      return;
-    case 0xC0: // cpy imm
-      op_cpy(s, get_instruction_byte(s));
-      return;
-
-    case 0xE0: // cpx imm
-      op_cpx(s, get_instruction_byte(s));
-      return;
-
-    case 0x89: // bit imm
-      op_bit(s, get_instruction_byte(s));
-      return;
-    case 0x24: // bit zp
-      op_bit(s, s->read(s->hardware, zeropage(s)));
-      return;
-    case 0x34: // bit zp,x
-      op_bit(s, s->read(s->hardware, zeropage_x(s)));
-      return;
-    case 0x2c: // bit abs
-      op_bit(s, s->read(s->hardware, absolute(s)));
-      return;
-    case 0x3c: // bit abs,x
-      op_bit(s, s->read(s->hardware, absolute_x(s)));
-      return;
-
-    case 0x1a: // ina
-      s->a++;
-      update_nz(s, s->a);
-      return;
-    case 0x3a: // dea
-      s->a--;
-      update_nz(s, s->a);
-      return;
-
-    case 0xe8: // inx
-      s->x++;
-      update_nz(s, s->x);
-      return;
-    case 0xca: // dex
-      s->x--;
-      update_nz(s, s->x);
-      return;
-
-    case 0xc8: // iny
-      s->y++;
-      update_nz(s, s->y);
-      return;
-    case 0x88: // dey
-      s->y--;
-      update_nz(s, s->y);
-      return;
-
-    case 0x5a: // phy
-      push(s, s->y);
-      return;
-    case 0x6a: // ply
-      s->y = pop(s);
-      return;
-
-    case 0xda: // phx
-      push(s, s->x);
-      return;
-    case 0xfa: // plx
-      s->x = pop(s);
-      return;
-    case 0x08: // php
-      push(s, s->flags | 16);
-      return;
-    case 0x28: // plp
-      s->flags = pop(s);
-      return;
-
-    case 0x48: // pha
-      push(s, s->a | 16);
-      return;
-    case 0x68: // pla
-      s->a = pop(s);
-      return;
-
-    case 0x58: // cli
-      s->flags &= ~FLAG_NO_IRQ;
-      return;
-    case 0x78: // sei
-      s->flags |= FLAG_NO_IRQ;
-      return;
-
-    case 0x18: // clc
-      s->flags &= ~FLAG_CARRY;
-      return;
-    case 0x38: // sec
-      s->flags |= FLAG_CARRY;
-      return;
-
-    case 0x9a: // txs
-      s->s = s->x;
-      return;
-    case 0xba: // tsx
-      op_ldx(s, s->s);
-      return;
-
-
-    case 0x98: // tya
-      op_lda(s, s->y);
-      return;
-    case 0xa8: // tay
-      op_ldy(s, s->a);
-      return;
-
-    case 0xb8: // clv
-      s->flags &= ~FLAG_OVERFLOW;
-      return;
-
-    case 0xd8: // cld
-      s->flags &= ~FLAG_DECIMAL;
-      return;
-    case 0xf8: // sed
-      s->flags |= FLAG_DECIMAL;
-      return;
-
-    case 0xea: // nop
-      return;
+#define IMMEDIATE_OP(name, op) \
+  static void CORE(name)(struct cpu_state *s) { \
+    op(s, get_instruction_byte(s)); \
+  }
 
+#define STORE_OP(name, mode, value) \
+  static void CORE(name)(struct cpu_state *s) { \
+    uint16_t address = CORE(mode)(s); \
+    BUS_WRITE(s, address, value); \
   }
 
-  // main instructions
-  if(cc == 1) {
-    static const address_mode modes[] = {
-      indirect_x,
-      zeropage,
-      NULL,
-      absolute,
-      indirect_y,
-      zeropage_x,
-      absolute_y,
-      absolute_x
-    };
-
-    if(aaa == 4) { // STA
-      address = modes[bbb](s);
-      s->write(s->hardware, address, s->a);
-      return;
-    } else {      // not STA
-      if(bbb == 2) { // immediate
-        value = get_instruction_byte(s);
-      } else { // memory
-        value = s->read(s->hardware, modes[bbb](s));
-      }
+#define RMW_OP(name, mode, op) \
+  static void CORE(name)(struct cpu_state *s) { \
+    uint16_t address = CORE(mode)(s); \
+    BUS_WRITE(s, address, op(s, BUS_READ(s, address))); \
+  }
 
-      main_ops[aaa](s, value);
-    }
+#define ACCUMULATOR_OP(name, op) \
+  static void CORE(name)(struct cpu_state *s) { \
+    s->a = op(s, s->a); \
+  }
 
-  } else if(cc == 2) { // mostly read-modify-write
-    if(bbb == 4) { // indirect zeropage
-      if(aaa == 4) { // STA
-        s->write(s->hardware, indirect(s), s->a);
-      } else {      // not STA
-        value = s->read(s->hardware, indirect(s));
-        main_ops[aaa](s, value);
-      }
-      return;
-    }
+#define BRANCH_OP(name, condition) \
+  static void CORE(name)(struct cpu_state *s) { \
+    uint8_t offset = get_instruction_byte(s); \
+    if(condition) \
+      branch(s, offset); \
+  }
 
-    switch(opcode) {
-      // ldx
-      case 0xa2:
-        op_ldx(s, get_instruction_byte(s));
-        return;
-      case 0xa6:
-        op_ldx(s, s->read(s->hardware, zeropage(s)));
-        return;
-      case 0xae:
-        op_ldx(s, s->read(s->hardware, absolute(s)));
-        return;
-      case 0xb6:
-        op_ldx(s, s->read(s->hardware, zeropage_y(s)));
-        return;
-      case 0xbe:
-        op_ldx(s, s->read(s->hardware, absolute_y(s)));
-        return;
-      case 0xaa:
-        op_ldx(s, s->a);
-        return;
-      // stx
-      case 0x86:
-        s->write(s, zeropage(s), s->x);
-        return;
-      case 0x8e:
-        s->write(s, absolute(s), s->x);
-        return;
-      case 0x96:
-        s->write(s, zeropage(s), s->x);
-        return;
-      case 0x8a:
-        op_lda(s, s->x);
-        return;
-    }
+#define IMPLIED_OP(name, body) \
+  static void CORE(name)(struct cpu_state *s) { \
+    body; \
+  }
 
-    switch(bbb) {
-      case 1:
-        address = zeropage(s);
-        value = s->read(s->hardware, address);
-        break;
-      case 2:
-        value = s->a;
-        break;
-      case 3:
-        address = absolute(s);
-        value = s->read(s->hardware, address);
-        break;
-      case 5:
-        address = zeropage_x(s);
-        value = s->read(s->hardware, address);
-        break;
-      case 7:
-        address = absolute_x(s);
-        value = s->read(s->hardware, address);
-        break;
-    }
+// the eight addressing modes the main ALU instructions support
+#define ALU_OP(name, op) \
+  READ_OP(name##_izx, indirect_x, op) \
+  READ_OP(name##_zp, zeropage, op) \
+  IMMEDIATE_OP(name##_imm, op) \
+  READ_OP(name##_abs, absolute, op) \
+  READ_OP(name##_izy, indirect_y_read, op) \
+  READ_OP(name##_zpx, zeropage_x, op) \
+  READ_OP(name##_aby, absolute_y_read, op) \
+  READ_OP(name##_abx, absolute_x_read, op) \
+  READ_OP(name##_izp, indirect, op)
+
+// shifts and rotates take the extra cycle when abs,X crosses a page, but
+// INC and DEC always take it, so theirs is in opcode_cycles
+#define SHIFT_OP(name, op, abx_mode) \
+  RMW_OP(name##_zp, zeropage, op) \
+  RMW_OP(name##_zpx, zeropage_x, op) \
+  RMW_OP(name##_abs, absolute, op) \
+  RMW_OP(name##_abx, abx_mode, op) \
+  ACCUMULATOR_OP(name##_a, op)
+
+// zeropage bit instructions
+#define BIT_BRANCH_OP(name, bit, set) \
+  static void CORE(name)(struct cpu_state *s) { \
+    uint16_t address = CORE(zeropage)(s); \
+    uint8_t offset = get_instruction_byte(s); \
+    if(((BUS_READ(s, address) >> bit) & 1) == set) \
+      branch(s, offset); \
+  }
 
-    switch(aaa) {
-      case 0: // asl
-        s->flags &= ~FLAG_CARRY;
-        if(value & 0x80)
-          s->flags |= FLAG_CARRY;
-        value <<= 1;
-        break;
-      case 1: // rol
-        temp = s->flags & FLAG_CARRY;
-        s->flags &= ~FLAG_CARRY;
-        if(value & 0x80)
-          s->flags |= FLAG_CARRY;
-        value = (value << 1) | (temp?1:0);
-        break;
-      case 2: // lsr
-        s->flags &= ~FLAG_CARRY;
-        if(value & 0x01)
-          s->flags |= FLAG_CARRY;
-        value >>= 1;
-        break;
-      case 3: // ror
-        temp = s->flags & FLAG_CARRY;
-        s->flags &= ~FLAG_CARRY;
-        if(value & 0x01)
-          s->flags |= FLAG_CARRY;
-        value = (value >> 1) | (temp?0x80:0);
-        break;
-      case 6: // dec
-        value--;
-        break;
-      case 7: // inc
-        value++;
-        break;
-    }
-    update_nz(s, value);
-
-    switch(bbb) {
-      case 1:
-      case 3:
-      case 5:
-      case 7:
-        s->write(s->hardware, address, value);
-        break;
+#define BIT_SET_OP(name, bit, set) \
+  static void CORE(name)(struct cpu_state *s) { \
+    uint16_t address = CORE(zeropage)(s); \
+    uint8_t value = BUS_READ(s, address); \
+    BUS_WRITE(s, address, set ? (value | (1 << bit)) : (value & ~(1 << bit))); \
+  }
+
+#define BIT_OPS(bit) \
+  BIT_BRANCH_OP(bbr##bit, bit, 0) \
+  BIT_BRANCH_OP(bbs##bit, bit, 1) \
+  BIT_SET_OP(rmb##bit, bit, 0) \
+  BIT_SET_OP(smb##bit, bit, 1)
+
+// Every handler, in opcode order. cpu_core.h builds a table out of this
+// for each copy of the core.
+#define OPCODE_TABLE(X) \
+/* 0x00 */ X(brk)     X(ora_izx) X(nop2)    X(nop)     X(tsb_zp)  X(ora_zp)  X(asl_zp)  X(rmb0) \
+/* 0x08 */ X(php)     X(ora_imm) X(asl_a)   X(nop)     X(tsb_abs) X(ora_abs) X(asl_abs) X(bbr0) \
+/* 0x10 */ X(bpl)     X(ora_izy) X(ora_izp) X(nop)     X(trb_zp)  X(ora_zpx) X(asl_zpx) X(rmb1) \
+/* 0x18 */ X(clc)     X(ora_aby) X(inc_a)   X(nop)     X(trb_abs) X(ora_abx) X(asl_abx) X(bbr1) \
+/* 0x20 */ X(jsr)     X(and_izx) X(nop2)    X(nop)     X(bit_zp)  X(and_zp)  X(rol_zp)  X(rmb2) \
+/* 0x28 */ X(plp)     X(and_imm) X(rol_a)   X(nop)     X(bit_abs) X(and_abs) X(rol_abs) X(bbr2) \
+/* 0x30 */ X(bmi)     X(and_izy) X(and_izp) X(nop)     X(bit_zpx) X(and_zpx) X(rol_zpx) X(rmb3) \
+/* 0x38 */ X(sec)     X(and_aby) X(dec_a)   X(nop)     X(bit_abx) X(and_abx) X(rol_abx) X(bbr3) \
+/* 0x40 */ X(rti)     X(eor_izx) X(nop2)    X(nop)     X(nop2)    X(eor_zp)  X(lsr_zp)  X(rmb4) \
+/* 0x48 */ X(pha)     X(eor_imm) X(lsr_a)   X(nop)     X(jmp_abs) X(eor_abs) X(lsr_abs) X(bbr4) \
+/* 0x50 */ X(bvc)     X(eor_izy) X(eor_izp) X(nop)     X(nop2)    X(eor_zpx) X(lsr_zpx) X(rmb5) \
+/* 0x58 */ X(cli)     X(eor_aby) X(phy)     X(nop)     X(nop3)    X(eor_abx) X(lsr_abx) X(bbr5) \
+/* 0x60 */ X(rts)     X(adc_izx) X(nop2)    X(nop)     X(stz_zp)  X(adc_zp)  X(ror_zp)  X(rmb6) \
+/* 0x68 */ X(pla)     X(adc_imm) X(ror_a)   X(nop)     X(jmp_ind) X(adc_abs) X(ror_abs) X(bbr6) \
+/* 0x70 */ X(bvs)     X(adc_izy) X(adc_izp) X(nop)     X(stz_zpx) X(adc_zpx) X(ror_zpx) X(rmb7) \
+/* 0x78 */ X(sei)     X(adc_aby) X(ply)     X(nop)     X(jmp_iax) X(adc_abx) X(ror_abx) X(bbr7) \
+/* 0x80 */ X(bra)     X(sta_izx) X(nop2)    X(nop)     X(sty_zp)  X(sta_zp)  X(stx_zp)  X(smb0) \
+/* 0x88 */ X(dey)     X(bit_imm) X(txa)     X(nop)     X(sty_abs) X(sta_abs) X(stx_abs) X(bbs0) \
+/* 0x90 */ X(bcc)     X(sta_izy) X(sta_izp) X(nop)     X(sty_zpx) X(sta_zpx) X(stx_zpy) X(smb1) \
+/* 0x98 */ X(tya)     X(sta_aby) X(txs)     X(nop)     X(stz_abs) X(sta_abx) X(stz_abx) X(bbs1) \
+/* 0xa0 */ X(ldy_imm) X(lda_izx) X(ldx_imm) X(nop)     X(ldy_zp)  X(lda_zp)  X(ldx_zp)  X(smb2) \
+/* 0xa8 */ X(tay)     X(lda_imm) X(tax)     X(nop)     X(ldy_abs) X(lda_abs) X(ldx_abs) X(bbs2) \
+/* 0xb0 */ X(bcs)     X(lda_izy) X(lda_izp) X(nop)     X(ldy_zpx) X(lda_zpx) X(ldx_zpy) X(smb3) \
+/* 0xb8 */ X(clv)     X(lda_aby) X(tsx)     X(nop)     X(ldy_abx) X(lda_abx) X(ldx_aby) X(bbs3) \
+/* 0xc0 */ X(cpy_imm) X(cmp_izx) X(nop2)    X(nop)     X(cpy_zp)  X(cmp_zp)  X(dec_zp)  X(smb4) \
+/* 0xc8 */ X(iny)     X(cmp_imm) X(dex)     X(wai)     X(cpy_abs) X(cmp_abs) X(dec_abs) X(bbs4) \
+/* 0xd0 */ X(bne)     X(cmp_izy) X(cmp_izp) X(nop)     X(nop2)    X(cmp_zpx) X(dec_zpx) X(smb5) \
+/* 0xd8 */ X(cld)     X(cmp_aby) X(phx)     X(stp)     X(nop3)    X(cmp_abx) X(dec_abx) X(bbs5) \
+/* 0xe0 */ X(cpx_imm) X(sbc_izx) X(nop2)    X(nop)     X(cpx_zp)  X(sbc_zp)  X(inc_zp)  X(smb6) \
+/* 0xe8 */ X(inx)     X(sbc_imm) X(nop)     X(nop)     X(cpx_abs) X(sbc_abs) X(inc_abs) X(bbs6) \
+/* 0xf0 */ X(beq)     X(sbc_izy) X(sbc_izp) X(nop)     X(nop2)    X(sbc_zpx) X(inc_zpx) X(smb7) \
+/* 0xf8 */ X(sed)     X(sbc_aby) X(plx)     X(nop)     X(nop3)    X(sbc_abx) X(inc_abx) X(bbs7)
+
+#define CORE_TABLE_ENTRY(name) CORE(name),
+
+// base cycle counts for each opcode, page crossing and branch penalties are added by the handlers
+static const uint8_t opcode_cycles[256] = {
+/* 0x00 */ 7, 6, 2, 1, 5, 3, 5, 5, 3, 2, 2, 1, 6, 4, 6, 5,
+/* 0x10 */ 2, 5, 5, 1, 5, 4, 6, 5, 2, 4, 2, 1, 6, 4, 6, 5,
+/* 0x20 */ 6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 4, 4, 6, 5,
+/* 0x30 */ 2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 2, 1, 4, 4, 6, 5,
+/* 0x40 */ 6, 6, 2, 1, 3, 3, 5, 5, 3, 2, 2, 1, 3, 4, 6, 5,
+/* 0x50 */ 2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 1, 8, 4, 6, 5,
+/* 0x60 */ 6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 6, 4, 6, 5,
+/* 0x70 */ 2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 6, 4, 6, 5,
+/* 0x80 */ 2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5,
+/* 0x90 */ 2, 6, 5, 1, 4, 4, 4, 5, 2, 5, 2, 1, 4, 5, 5, 5,
+/* 0xa0 */ 2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5,
+/* 0xb0 */ 2, 5, 5, 1, 4, 4, 4, 5, 2, 4, 2, 1, 4, 4, 4, 5,
+/* 0xc0 */ 2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 3, 4, 4, 6, 5,
+/* 0xd0 */ 2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 3, 4, 4, 7, 5,
+/* 0xe0 */ 2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 1, 4, 4, 6, 5,
+/* 0xf0 */ 2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 4, 4, 7, 5,
+};
+
+// operand bytes each opcode fetches; nop2 and nop3 skip theirs without a read
+static const uint8_t opcode_operands[256] = {
+/* 0x00 */ 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0x10 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2,
+/* 0x20 */ 2, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0x30 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2,
+/* 0x40 */ 0, 1, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0x50 */ 1, 1, 1, 0, 0, 1, 1, 1, 0, 2, 0, 0, 0, 2, 2, 2,
+/* 0x60 */ 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0x70 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2,
+/* 0x80 */ 1, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0x90 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2,
+/* 0xa0 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0xb0 */ 1, 1, 1, 0, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 2,
+/* 0xc0 */ 1, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0xd0 */ 1, 1, 1, 0, 0, 1, 1, 1, 0, 2, 0, 0, 0, 2, 2, 2,
+/* 0xe0 */ 1, 1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 0, 2, 2, 2, 2,
+/* 0xf0 */ 1, 1, 1, 0, 0, 1, 1, 1, 0, 2, 0, 0, 0, 2, 2, 2,
+};
+
+static void decode_block(struct code_block *block, const uint8_t *code, int available, const opcode_handler *table);
+
+// ------------------------------------------------------------------
+// The core is built twice. One copy goes through cpu_state.read and write,
+// so anything can be put on the bus, like trace.h and debugger.h do. The
+// other calls the Miuchiz's bus directly, so its fast paths inline into
+// every handler. make GENERIC_CPU=1 leaves the second one out.
+
+#define CORE(name) generic_##name
+#define BUS_READ(s, address) (s)->read((s)->hardware, address)
+#define BUS_WRITE(s, address, value) (s)->write((s)->hardware, address, value)
+#include "cpu_core.h"
+#undef CORE
+#undef BUS_READ
+#undef BUS_WRITE
+
+#ifndef MIUCHIZ_GENERIC_CPU
+#define CORE(name) inlined_##name
+#define BUS_READ(s, address) miuchiz_read((s)->hardware, address)
+#define BUS_WRITE(s, address, value) miuchiz_write((s)->hardware, address, value)
+#include "cpu_core.h"
+#undef CORE
+#undef BUS_READ
+#undef BUS_WRITE
+#endif
+
+// ------------------------------------------------------------------
+
+// length of each instruction that can't change anything but the registers,
+// or 0 for ones that can (or that jump), for idle_loop_check()
+static const uint8_t idle_safe_length[256] = {
+/* 0x00 */ 0, 2, 0, 0, 0, 2, 0, 0, 0, 2, 1, 0, 0, 3, 0, 0,
+/* 0x10 */ 0, 2, 2, 0, 0, 2, 0, 0, 1, 3, 1, 0, 0, 3, 0, 0,
+/* 0x20 */ 0, 2, 0, 0, 2, 2, 0, 0, 0, 2, 1, 0, 3, 3, 0, 0,
+/* 0x30 */ 0, 2, 2, 0, 2, 2, 0, 0, 1, 3, 1, 0, 3, 3, 0, 0,
+/* 0x40 */ 0, 2, 0, 0, 0, 2, 0, 0, 0, 2, 1, 0, 0, 3, 0, 0,
+/* 0x50 */ 0, 2, 2, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 3, 0, 0,
+/* 0x60 */ 0, 2, 0, 0, 0, 2, 0, 0, 0, 2, 1, 0, 0, 3, 0, 0,
+/* 0x70 */ 0, 2, 2, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 3, 0, 0,
+/* 0x80 */ 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 1, 0, 0, 0, 0, 0,
+/* 0x90 */ 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0,
+/* 0xa0 */ 2, 2, 2, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* 0xb0 */ 0, 2, 2, 0, 2, 2, 2, 0, 1, 3, 1, 0, 3, 3, 3, 0,
+/* 0xc0 */ 2, 2, 0, 0, 2, 2, 0, 0, 1, 2, 1, 0, 3, 3, 0, 0,
+/* 0xd0 */ 0, 2, 2, 0, 0, 2, 0, 0, 1, 3, 0, 0, 0, 3, 0, 0,
+/* 0xe0 */ 2, 2, 0, 0, 2, 2, 0, 0, 1, 2, 1, 0, 3, 3, 0, 0,
+/* 0xf0 */ 0, 2, 2, 0, 0, 2, 0, 0, 1, 3, 0, 0, 0, 3, 0, 0,
+};
+
+// Checks that a loop is only safe instructions followed by the branch that
+// ends it, so going around it again can't change anything
+static int idle_loop_body(struct cpu_state *s, uint16_t address, uint16_t end) {
+  while(address < end) {
+    uint8_t opcode = s->read(s->hardware, address);
+    if((opcode & 0x0f) == 0x0f) // BBR/BBS
+      return address + 3 == end;
+    if((opcode & 0x1f) == 0x10 || opcode == 0x80) // Bxx/BRA
+      return address + 2 == end;
+    if(!idle_safe_length[opcode])
+      return 0;
+    address += idle_safe_length[opcode];
+  }
+  return 0;
+}
+
+static void record_idle_loop(struct cpu_state *s, uint16_t start, uint16_t end, int cycles, int skipped) {
+  struct idle_loop *slot = NULL, *least = &s->idle_loops[0];
+  for(int i=0; i<IDLE_LOOP_SLOTS; i++) {
+    struct idle_loop *loop = &s->idle_loops[i];
+    if(loop->skips && loop->start == start && loop->end == end) {
+      slot = loop;
+      break;
     }
+    if(loop->skipped < least->skipped)
+      least = loop;
+  }
+  if(!slot) {
+    // make room by forgetting the loop that saved the least time
+    slot = least;
+    slot->start = start;
+    slot->end = end;
+    slot->skips = 0;
+    slot->skipped = 0;
+  }
+  slot->cycles = cycles;
+  slot->skips++;
+  slot->skipped += skipped;
+}
 
-  } else if(cc == 0) {
-
-  } else if(cc == 3) {
-    int bit = (opcode >> 4) & 3;
-    if((opcode & 7) == 7) { // zeropage bit instructions
-      address = zeropage(s);
-      if(opcode & 8) { // test-and-branch
-        temp = get_instruction_byte(s);
-        if(opcode & 128) {
-          if(s->read(s->hardware, address) & (1 << bit))
-            branch(s, temp);
-        } else {
-          if(!(s->read(s->hardware, address) & (1 << bit)))
-            branch(s, temp);
-        }
-      } else { // bit set/reset
-        if(opcode & 128) {
-          s->write(s->hardware, address, s->read(s->hardware, address) | (1 << bit));
-        } else {
-          s->write(s->hardware, address, s->read(s->hardware, address) & ~(1 << bit));
-        }
-      }
+// Called when a short loop branches back. If the registers are the same as
+// the last time around, and nothing in the loop can write memory, then the
+// loop is polling something only an event can change. Slices end at the
+// next event, so the whole trips around that still fit in this one can be
+// skipped. The part of a trip left over runs normally, so the slice ends
+// where running the loop would have left it.
+static void idle_loop_check(struct cpu_state *s, uint16_t target) {
+  uint16_t end = s->pc;
+  if(!s->idle.armed || s->idle.end != end || s->idle.a != s->a || s->idle.x != s->x ||
+     s->idle.y != s->y || s->idle.s != s->s || s->idle.flags != cpu_get_flags(s)) {
+    s->idle.armed = 1;
+    s->idle.rejected = 0;
+    s->idle.end = end;
+    s->idle.a = s->a;
+    s->idle.x = s->x;
+    s->idle.y = s->y;
+    s->idle.s = s->s;
+    s->idle.flags = cpu_get_flags(s);
+    s->idle.cycles = s->cycles;
+    return;
+  }
+  int cycles = s->cycles - s->idle.cycles;
+  s->idle.cycles = s->cycles;
+  if(s->idle.rejected || cycles <= 0 || s->cycles >= 0)
+    return;
+  if(!idle_loop_body(s, target, end)) {
+    s->idle.rejected = 1;
+  } else if(-s->cycles >= cycles) {
+    int trips = -s->cycles / cycles;
+    s->cycles += trips * cycles;
+    s->idle.cycles = s->cycles;
+    record_idle_loop(s, target, end, cycles, trips * cycles);
+  }
+  // put the open bus value back the way the branch left it
+  s->read(s->hardware, end - 1);
+}
+
+// ------------------------------------------------------------------
+
+// Takes an interrupt through the given vector, the same way BRK does
+void cpu_interrupt(struct cpu_state *s, uint16_t vector) {
+  if(s->trace)
+    trace_interrupt(s->trace, vector);
+  generic_push(s, s->pc >> 8);
+  generic_push(s, s->pc & 255);
+  generic_push(s, cpu_get_flags(s) & ~FLAG_BREAK);
+  s->flags = (s->flags | FLAG_NO_IRQ) & ~FLAG_DECIMAL;
+  uint16_t address = s->read(s->hardware, vector);
+  s->pc = (s->read(s->hardware, vector + 1) << 8) | address;
+  s->cycles += 7;
+#ifdef MIUCHIZ_PROFILER
+  if(s->profiler)
+    profile_interrupt(s->profiler, s);
+#endif
+}
+
+void run_instruction(struct cpu_state *s) {
+  generic_step(s, NULL);
+}
+
+// ------------------------------------------------------------------
+
+static int instruction_length(uint8_t opcode) {
+  if(generic_opcode_table[opcode] == generic_nop2)
+    return 2;
+  if(generic_opcode_table[opcode] == generic_nop3)
+    return 3;
+  return opcode_operands[opcode] + 1;
+}
+
+// jumps, branches, and anything else that doesn't just go on to the next instruction
+static int ends_block(uint8_t opcode) {
+  switch(opcode) {
+    case 0x00: case 0x20: case 0x40: case 0x4c: case 0x60: case 0x6c:
+    case 0x7c: case 0x80: case 0xcb: case 0xdb:
+      return 1;
+  }
+  return (opcode & 0x1f) == 0x10 || (opcode & 0x0f) == 0x0f;
+}
+
+// Decodes from code up to the end of its page. Instructions that spill onto
+// the next page are left to run_instruction(), since that page can be
+// banked separately.
+static void decode_block(struct code_block *block, const uint8_t *code, int available, const opcode_handler *table) {
+  block->key = code;
+  block->count = 0;
+  while(block->count < BLOCK_LENGTH) {
+    uint8_t opcode = code[0];
+    int length = instruction_length(opcode);
+    if(length > available)
+      break;
+    struct block_op *op = &block->ops[block->count++];
+    op->handler = table[opcode];
+    op->operand[0] = length > 1 ? code[1] : 0;
+    op->operand[1] = length > 2 ? code[2] : 0;
+    op->last_byte = code[opcode_operands[opcode]];
+    op->length = length;
+    op->cycles = opcode_cycles[opcode];
+    if(ends_block(opcode))
+      break;
+    code += length;
+    available -= length;
+  }
+}
+
+// Runs for the given number of cycles and returns how many instructions that
+// took. s->cycles goes negative by the amount still owed and any overshoot
+// from the last instruction is paid back next time.
+// Interprets one instruction at a time, stopping at breakpoints and after
+// an instruction that hit a watchpoint. Kept apart from run_cycles() so the
+// usual loop doesn't have to check for either.
+static int run_cycles_debug(struct cpu_state *s, struct debugger *d) {
+  int instructions = 0;
+  while(s->cycles < 0) {
+    if(s->waiting) {
+      s->cycles = 0;
+      break;
     }
+    if(d->breakpoint_filter[s->pc & 0xff] && debugger_check_breakpoint(d, s->pc))
+      break;
+    generic_step(s, d);
+    instructions++;
+    if(d->hit)
+      break;
   }
+  if(d->hit)
+    end_slice(d->hw);
+  return instructions;
+}
 
+int run_cycles(struct cpu_state *s, int cycles) {
+  s->cycles -= cycles;
+  s->idle.armed = 0; // a new slice may have taken an interrupt or changed memory
+  if(s->debugger)
+    return run_cycles_debug(s, s->debugger);
+#ifndef MIUCHIZ_GENERIC_CPU
+  // the Miuchiz's own bus, not something trace.h or debugger.h put around it
+  if(s->read == read_handler && s->write == write_handler)
+    return inlined_run(s);
+#endif
+  return generic_run(s);
 }
@@ -0,0 +1,337 @@
+// The CPU core proper, which cpu.c includes once for each bus it's built
+// for. CORE(name) gives each copy its own names, and BUS_READ() and
+// BUS_WRITE() are how that copy gets at memory. No include guard, since
+// being included more than once is the point.
+
+static inline uint16_t CORE(zeropage)(struct cpu_state *s) {
+  return get_instruction_byte(s);
+}
+
+static inline uint16_t CORE(zeropage_x)(struct cpu_state *s) {
+  return (get_instruction_byte(s) + s->x) & 0xff;
+}
+
+static inline uint16_t CORE(zeropage_y)(struct cpu_state *s) {
+  return (get_instruction_byte(s) + s->y) & 0xff;
+}
+
+static inline uint16_t CORE(absolute)(struct cpu_state *s) {
+  uint8_t low = get_instruction_byte(s);
+  uint8_t high = get_instruction_byte(s);
+  return (high << 8) | low;
+}
+
+static inline uint16_t CORE(absolute_x)(struct cpu_state *s) {
+  uint8_t low = get_instruction_byte(s);
+  uint8_t high = get_instruction_byte(s);
+  return ((high << 8) | low) + s->x;
+}
+
+static inline uint16_t CORE(absolute_y)(struct cpu_state *s) {
+  uint8_t low = get_instruction_byte(s);
+  uint8_t high = get_instruction_byte(s);
+  return ((high << 8) | low) + s->y;
+}
+
+static inline uint16_t CORE(absolute_x_read)(struct cpu_state *s) {
+  uint16_t base = CORE(absolute)(s);
+  return page_cross(s, base, base + s->x);
+}
+
+static inline uint16_t CORE(absolute_y_read)(struct cpu_state *s) {
+  uint16_t base = CORE(absolute)(s);
+  return page_cross(s, base, base + s->y);
+}
+
+static inline uint16_t CORE(indirect)(struct cpu_state *s) {
+  uint8_t zp = get_instruction_byte(s);
+  uint8_t low = BUS_READ(s, zp);
+  uint8_t high = BUS_READ(s, zp+1);
+  return ((high << 8) | low);
+}
+
+static inline uint16_t CORE(indirect_x)(struct cpu_state *s) {
+  uint8_t zp = get_instruction_byte(s);
+  uint8_t low = BUS_READ(s, (zp+s->x)&0xff);
+  uint8_t high = BUS_READ(s, (zp+s->x+1)&0xff);
+  return ((high << 8) | low);
+}
+
+static inline uint16_t CORE(indirect_y)(struct cpu_state *s) {
+  uint8_t zp = get_instruction_byte(s);
+  uint8_t low = BUS_READ(s, zp);
+  uint8_t high = BUS_READ(s, zp+1);
+  return ((high << 8) | low) + s->y;
+}
+
+static inline uint16_t CORE(indirect_y_read)(struct cpu_state *s) {
+  uint8_t zp = get_instruction_byte(s);
+  uint8_t low = BUS_READ(s, zp);
+  uint8_t high = BUS_READ(s, zp+1);
+  uint16_t base = (high << 8) | low;
+  return page_cross(s, base, base + s->y);
+}
+
+static inline void CORE(push)(struct cpu_state *s, uint8_t value) {
+  BUS_WRITE(s, 0x100+(s->s--), value);
+}
+
+static inline uint8_t CORE(pop)(struct cpu_state *s) {
+  return BUS_READ(s, 0x100+(++s->s));
+}
+
+// ------------------------------------------------------------------
+// The handlers, see the macros in cpu.c
+
+ALU_OP(ora, op_ora)
+ALU_OP(and, op_and)
+ALU_OP(eor, op_eor)
+ALU_OP(adc, op_adc)
+ALU_OP(lda, op_lda)
+ALU_OP(cmp, op_cmp)
+ALU_OP(sbc, op_sbc)
+
+STORE_OP(sta_izx, indirect_x, s->a)
+STORE_OP(sta_zp, zeropage, s->a)
+STORE_OP(sta_abs, absolute, s->a)
+STORE_OP(sta_izy, indirect_y, s->a)
+STORE_OP(sta_zpx, zeropage_x, s->a)
+STORE_OP(sta_aby, absolute_y, s->a)
+STORE_OP(sta_abx, absolute_x, s->a)
+STORE_OP(sta_izp, indirect, s->a)
+STORE_OP(stx_zp, zeropage, s->x)
+STORE_OP(stx_zpy, zeropage_y, s->x)
+STORE_OP(stx_abs, absolute, s->x)
+STORE_OP(sty_zp, zeropage, s->y)
+STORE_OP(sty_zpx, zeropage_x, s->y)
+STORE_OP(sty_abs, absolute, s->y)
+STORE_OP(stz_zp, zeropage, 0)
+STORE_OP(stz_zpx, zeropage_x, 0)
+STORE_OP(stz_abs, absolute, 0)
+STORE_OP(stz_abx, absolute_x, 0)
+
+IMMEDIATE_OP(ldx_imm, op_ldx)
+READ_OP(ldx_zp, zeropage, op_ldx)
+READ_OP(ldx_zpy, zeropage_y, op_ldx)
+READ_OP(ldx_abs, absolute, op_ldx)
+READ_OP(ldx_aby, absolute_y_read, op_ldx)
+IMMEDIATE_OP(ldy_imm, op_ldy)
+READ_OP(ldy_zp, zeropage, op_ldy)
+READ_OP(ldy_zpx, zeropage_x, op_ldy)
+READ_OP(ldy_abs, absolute, op_ldy)
+READ_OP(ldy_abx, absolute_x_read, op_ldy)
+
+IMMEDIATE_OP(cpx_imm, op_cpx)
+READ_OP(cpx_zp, zeropage, op_cpx)
+READ_OP(cpx_abs, absolute, op_cpx)
+IMMEDIATE_OP(cpy_imm, op_cpy)
+READ_OP(cpy_zp, zeropage, op_cpy)
+READ_OP(cpy_abs, absolute, op_cpy)
+
+IMMEDIATE_OP(bit_imm, op_bit_imm)
+READ_OP(bit_zp, zeropage, op_bit)
+READ_OP(bit_zpx, zeropage_x, op_bit)
+READ_OP(bit_abs, absolute, op_bit)
+READ_OP(bit_abx, absolute_x_read, op_bit)
+
+SHIFT_OP(asl, op_asl, absolute_x_read)
+SHIFT_OP(rol, op_rol, absolute_x_read)
+SHIFT_OP(lsr, op_lsr, absolute_x_read)
+SHIFT_OP(ror, op_ror, absolute_x_read)
+SHIFT_OP(inc, op_inc, absolute_x)
+SHIFT_OP(dec, op_dec, absolute_x)
+
+RMW_OP(tsb_zp, zeropage, op_tsb)
+RMW_OP(tsb_abs, absolute, op_tsb)
+RMW_OP(trb_zp, zeropage, op_trb)
+RMW_OP(trb_abs, absolute, op_trb)
+
+BIT_OPS(0) BIT_OPS(1) BIT_OPS(2) BIT_OPS(3)
+BIT_OPS(4) BIT_OPS(5) BIT_OPS(6) BIT_OPS(7)
+
+BRANCH_OP(bpl, !flag_negative(s))
+BRANCH_OP(bmi, flag_negative(s))
+BRANCH_OP(bvc, !(s->overflow & 0x80))
+BRANCH_OP(bvs, s->overflow & 0x80)
+BRANCH_OP(bcc, !s->carry)
+BRANCH_OP(bcs, s->carry)
+BRANCH_OP(bne, !flag_zero(s))
+BRANCH_OP(beq, flag_zero(s))
+BRANCH_OP(bra, 1)
+
+IMPLIED_OP(inx, op_ldx(s, s->x + 1))
+IMPLIED_OP(dex, op_ldx(s, s->x - 1))
+IMPLIED_OP(iny, op_ldy(s, s->y + 1))
+IMPLIED_OP(dey, op_ldy(s, s->y - 1))
+IMPLIED_OP(tax, op_ldx(s, s->a))
+IMPLIED_OP(txa, op_lda(s, s->x))
+IMPLIED_OP(tay, op_ldy(s, s->a))
+IMPLIED_OP(tya, op_lda(s, s->y))
+IMPLIED_OP(tsx, op_ldx(s, s->s))
+IMPLIED_OP(txs, s->s = s->x)
+
+IMPLIED_OP(pha, CORE(push)(s, s->a))
+IMPLIED_OP(phx, CORE(push)(s, s->x))
+IMPLIED_OP(phy, CORE(push)(s, s->y))
+IMPLIED_OP(php, CORE(push)(s, cpu_get_flags(s) | FLAG_BREAK))
+IMPLIED_OP(pla, op_lda(s, CORE(pop)(s)))
+IMPLIED_OP(plx, op_ldx(s, CORE(pop)(s)))
+IMPLIED_OP(ply, op_ldy(s, CORE(pop)(s)))
+IMPLIED_OP(plp, cpu_set_flags(s, CORE(pop)(s)))
+
+IMPLIED_OP(clc, s->carry = 0)
+IMPLIED_OP(sec, s->carry = 1)
+IMPLIED_OP(cli, s->flags &= ~FLAG_NO_IRQ)
+IMPLIED_OP(sei, s->flags |= FLAG_NO_IRQ)
+IMPLIED_OP(cld, s->flags &= ~FLAG_DECIMAL)
+IMPLIED_OP(sed, s->flags |= FLAG_DECIMAL)
+IMPLIED_OP(clv, s->overflow = 0)
+
+// unused opcodes are NOPs of various lengths on the 65C02
+IMPLIED_OP(nop, )
+IMPLIED_OP(nop2, s->pc += 1)
+IMPLIED_OP(nop3, s->pc += 2)
+
+IMPLIED_OP(wai, s->waiting = CPU_WAITING)
+IMPLIED_OP(stp, s->waiting = CPU_STOPPED)
+
+static void CORE(brk)(struct cpu_state *s) {
+  uint16_t address = s->pc + 1;
+  CORE(push)(s, address >> 8);
+  CORE(push)(s, address & 255);
+  CORE(push)(s, cpu_get_flags(s) | FLAG_BREAK);
+  s->flags = (s->flags | FLAG_NO_IRQ) & ~FLAG_DECIMAL;
+  address = BUS_READ(s, 0xfffe);
+  s->pc = (BUS_READ(s, 0xffff) << 8) | address;
+}
+
+static void CORE(jmp_abs)(struct cpu_state *s) {
+  s->pc = CORE(absolute)(s);
+}
+
+static void CORE(jmp_ind)(struct cpu_state *s) {
+  uint16_t pointer = CORE(absolute)(s);
+  uint16_t address = BUS_READ(s, pointer);
+  s->pc = (BUS_READ(s, pointer+1) << 8) | address;
+}
+
+static void CORE(jmp_iax)(struct cpu_state *s) {
+  uint16_t pointer = CORE(absolute_x)(s);
+  uint16_t address = BUS_READ(s, pointer);
+  s->pc = (BUS_READ(s, pointer+1) << 8) | address;
+}
+
+static void CORE(jsr)(struct cpu_state *s) {
+  uint16_t address = CORE(absolute)(s);
+  CORE(push)(s, (s->pc-1)>>8);  // high
+  CORE(push)(s, (s->pc-1)&255); // low
+  s->pc = address;
+}
+
+static void CORE(rti)(struct cpu_state *s) {
+  cpu_set_flags(s, CORE(pop)(s));
+  uint16_t address = CORE(pop)(s);
+  s->pc = (CORE(pop)(s)<<8) | address;
+}
+
+static void CORE(rts)(struct cpu_state *s) {
+  uint16_t address = CORE(pop)(s);
+  address = (CORE(pop)(s)<<8) | address;
+  s->pc = address+1;
+}
+
+static const opcode_handler CORE(opcode_table)[256] = {
+  OPCODE_TABLE(CORE_TABLE_ENTRY)
+};
+
+// ------------------------------------------------------------------
+
+// The debugger's run loop gets its own copy of this, see run_cycles_debug()
+static inline void CORE(step)(struct cpu_state *s, struct debugger *debugger) {
+  if(s->waiting)
+    return;
+#ifdef MIUCHIZ_PROFILER
+  uint16_t pc = s->pc;
+  int cycles = s->cycles;
+#endif
+  if(s->trace)
+    trace_fetch(s->trace);
+  if(debugger) {
+    debugger->pc = s->pc;
+    debugger->fetching = 1;
+  }
+  uint8_t opcode = BUS_READ(s, s->pc++);
+  // every handler fetches all of its operands before touching memory, so
+  // reading them first doesn't change the order the bus sees
+  for(int i=0; i<opcode_operands[opcode]; i++)
+    s->fetched[i] = BUS_READ(s, s->pc + i);
+  s->operand = s->fetched;
+  if(debugger)
+    debugger->fetching = 0;
+  if(s->trace)
+    trace_instruction(s->trace, s->pc - 1, opcode);
+  s->cycles += opcode_cycles[opcode];
+  CORE(opcode_table)[opcode](s);
+#ifdef MIUCHIZ_PROFILER
+  if(s->profiler)
+    profile_instruction(s->profiler, s, pc, opcode, s->cycles - cycles);
+#endif
+}
+
+// Runs a block until it ends, jumps out, or the slice is over
+static int CORE(run_block)(struct cpu_state *s, const struct code_block *block) {
+  const struct block_op *op = block->ops, *end = op + block->count;
+  uint16_t next = s->pc;
+  int instructions = 0;
+  do {
+    next += op->length;
+    s->pc++;
+    s->operand = op->operand;
+    *s->open_bus = op->last_byte;
+    s->cycles += op->cycles;
+    op->handler(s);
+    instructions++;
+    op++;
+  } while(op < end && s->pc == next && s->cycles < 0);
+  return instructions;
+}
+
+// The usual run loop, see run_cycles()
+static int CORE(run)(struct cpu_state *s) {
+  int instructions = 0;
+  // cached blocks call the handlers they were decoded with
+  if(s->block_handlers != CORE(opcode_table)) {
+    for(int i=0; s->blocks && i<BLOCK_CACHE_SIZE; i++)
+      s->blocks[i].key = NULL;
+    s->block_handlers = CORE(opcode_table);
+  }
+  while(s->cycles < 0) {
+    if(s->waiting) {
+      // only an event can wake the CPU up and miuchiz_run() ends slices at
+      // the next one, so skip straight to the end
+      s->cycles = 0;
+      break;
+    }
+    uint8_t *page = s->code_map ? s->code_map[s->pc >> 8] : NULL;
+#ifdef MIUCHIZ_PROFILER
+    // the profiler needs to see every instruction
+    if(s->profiler)
+      page = NULL;
+#endif
+    if(page) {
+      // blocks are keyed by where the code is, not what address it's banked in at
+      const uint8_t *code = page + (s->pc & 0xff);
+      uintptr_t key = (uintptr_t)code;
+      struct code_block *block = &s->blocks[(key ^ (key >> 10)) & (BLOCK_CACHE_SIZE - 1)];
+      if(block->key != code)
+        decode_block(block, code, 256 - (s->pc & 0xff), CORE(opcode_table));
+      if(block->count) {
+        instructions += CORE(run_block)(s, block);
+        continue;
+      }
+    }
+    CORE(step)(s, NULL);
+    instructions++;
+  }
+  return instructions;
+}
@@ -0,0 +1,237 @@
+#include "debugger.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Works out which CPU pages can touch a watchpoint with the current banks.
+// Banks are at least 8KB, so a page is always one run of physical addresses.
+static void update_watch_pages(struct debugger *d) {
+  struct miuchiz_hardware *hw = d->hw;
+  d->watch_BRR = hw->BRR;
+  d->watch_PRR = hw->PRR;
+  d->watch_DRR = hw->DRR;
+  for(int page=0; page<256; page++) {
+    // the bottom of page zero is I/O, which can't be watched
+    uint32_t first = physical_address(hw, page ? page << 8 : 0x80);
+    uint32_t last = physical_address(hw, (page << 8) | 0xff);
+    d->watch_pages[page] = 0;
+    for(int i=0; i<d->watchpoint_count; i++) {
+      struct watchpoint *w = &d->watchpoints[i];
+      if(w->start <= last && w->end >= first)
+        d->watch_pages[page] |= w->kind;
+    }
+  }
+}
+
+static void check_watchpoints(struct debugger *d, uint16_t address, uint8_t value, int kind) {
+  struct miuchiz_hardware *hw = d->hw;
+  if(d->watch_BRR != hw->BRR || d->watch_PRR != hw->PRR || d->watch_DRR != hw->DRR)
+    update_watch_pages(d);
+  if(!(d->watch_pages[address >> 8] & kind) || address < 0x80 || d->fetching || d->hit)
+    return;
+  uint32_t physical = physical_address(hw, address);
+  for(int i=0; i<d->watchpoint_count; i++) {
+    struct watchpoint *w = &d->watchpoints[i];
+    if((w->kind & kind) && physical >= w->start && physical <= w->end) {
+      // the instruction finishes, then the debugger's run loop stops
+      d->hit = kind == WATCH_READ ? DEBUG_WATCH_READ : DEBUG_WATCH_WRITE;
+      d->hit_pc = d->pc;
+      d->hit_physical = physical;
+      d->hit_value = value;
+      return;
+    }
+  }
+}
+
+static uint8_t debug_read(void *h, uint16_t address) {
+  struct debugger *d = h;
+  uint8_t value = d->read(d->hardware, address);
+  check_watchpoints(d, address, value, WATCH_READ);
+  return value;
+}
+
+static void debug_write(void *h, uint16_t address, uint8_t value) {
+  struct debugger *d = h;
+  check_watchpoints(d, address, value, WATCH_WRITE);
+  d->write(d->hardware, address, value);
+}
+
+// What the debugger hooks into and restores: the CPU's own handlers, or if
+// a trace is running, the ones it replaced. That keeps the trace's handlers
+// outermost whichever was started first, so either can stop without
+// dropping the other's.
+struct hooks {
+  void **hardware;
+  uint8_t (**read)(void*, uint16_t);
+  void (**write)(void*, uint16_t, uint8_t);
+  int *skip_idle;
+};
+
+static struct hooks current_hooks(struct cpu_state *cpu) {
+  struct trace_buffer *t = cpu->trace;
+  if(t)
+    return (struct hooks){&t->hardware, &t->read, &t->write, &t->skip_idle};
+  return (struct hooks){&cpu->hardware, &cpu->read, &cpu->write, &cpu->skip_idle};
+}
+
+// Puts the CPU back the way it was, then hooks in again only as far as the
+// breakpoints and watchpoints that are set need it
+static void debugger_update(struct debugger *d) {
+  struct cpu_state *cpu = d->cpu;
+  struct hooks hooks = current_hooks(cpu);
+  if(d->watching) {
+    *hooks.hardware = d->hardware;
+    *hooks.read = d->read;
+    *hooks.write = d->write;
+    d->watching = 0;
+  }
+  if(d->installed) {
+    *hooks.skip_idle = d->skip_idle;
+    cpu->debugger = NULL;
+    d->installed = 0;
+  }
+
+  memset(d->breakpoint_filter, 0, sizeof(d->breakpoint_filter));
+  for(int i=0; i<d->breakpoint_count; i++)
+    d->breakpoint_filter[d->breakpoints[i] & 0xff] = 1;
+  if(!d->breakpoint_count && !d->watchpoint_count)
+    return;
+
+  // skipping polling loops would skip past breakpoints and reads in them
+  d->skip_idle = *hooks.skip_idle;
+  *hooks.skip_idle = 0;
+  cpu->skip_idle = 0;
+  cpu->debugger = d;
+  d->installed = 1;
+  if(d->watchpoint_count) {
+    d->hardware = *hooks.hardware;
+    d->read = *hooks.read;
+    d->write = *hooks.write;
+    *hooks.hardware = d;
+    *hooks.read = debug_read;
+    *hooks.write = debug_write;
+    d->watching = 1;
+    update_watch_pages(d);
+  }
+}
+
+void debugger_init(struct debugger *d, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  memset(d, 0, sizeof(*d));
+  d->cpu = cpu;
+  d->hw = hw;
+}
+
+int debugger_add_breakpoint(struct debugger *d, uint32_t physical) {
+  if(d->breakpoint_count >= DEBUG_BREAKPOINTS)
+    return -1;
+  d->breakpoints[d->breakpoint_count++] = physical;
+  debugger_update(d);
+  return 0;
+}
+
+int debugger_add_watchpoint(struct debugger *d, uint32_t start, uint32_t end, int kind) {
+  if(d->watchpoint_count >= DEBUG_WATCHPOINTS || (start >> 24) != (end >> 24) || start > end)
+    return -1;
+  struct watchpoint *w = &d->watchpoints[d->watchpoint_count++];
+  w->start = start;
+  w->end = end;
+  w->kind = kind;
+  debugger_update(d);
+  return 0;
+}
+
+// Removes every breakpoint and watchpoint, so the CPU runs at full speed again
+void debugger_clear(struct debugger *d) {
+  d->breakpoint_count = 0;
+  d->watchpoint_count = 0;
+  d->hit = DEBUG_RUNNING;
+  debugger_update(d);
+}
+
+void debugger_continue(struct debugger *d) {
+  if(d->hit == DEBUG_BREAKPOINT) {
+    d->resume = 1;
+    d->resume_pc = d->hit_pc;
+  }
+  d->hit = DEBUG_RUNNING;
+}
+
+// Called by the debugger's run loop before each instruction whose address
+// got through breakpoint_filter. Returns 1 if it should stop.
+int debugger_check_breakpoint(struct debugger *d, uint16_t pc) {
+  if(d->resume) {
+    d->resume = 0;
+    if(pc == d->resume_pc)
+      return 0;
+  }
+  uint32_t physical = physical_address(d->hw, pc);
+  for(int i=0; i<d->breakpoint_count; i++)
+    if(d->breakpoints[i] == physical) {
+      d->hit = DEBUG_BREAKPOINT;
+      d->hit_pc = pc;
+      d->hit_physical = physical;
+      return 1;
+    }
+  return 0;
+}
+
+// Reads "region:offset" with the offset in hex, like physical_region_name()
+// and the profiler write them
+int debugger_parse_address(const char *text, uint32_t *physical) {
+  const char *colon = strchr(text, ':');
+  if(!colon)
+    return -1;
+  for(uint32_t region=1; region<=4; region++) {
+    const char *name = physical_region_name(region << 24);
+    if(strlen(name) == (size_t)(colon - text) && !strncmp(text, name, colon - text)) {
+      char *end;
+      unsigned long offset = strtoul(colon + 1, &end, 16);
+      if(end == colon + 1 || *end || offset > 0xffffff)
+        return -1;
+      *physical = (region << 24) | offset;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Reads "region:start-end", or a single address like debugger_parse_address()
+int debugger_parse_range(const char *text, uint32_t *start, uint32_t *end) {
+  char buffer[64];
+  const char *dash = strchr(text, '-');
+  if(!dash) {
+    if(debugger_parse_address(text, start))
+      return -1;
+    *end = *start;
+    return 0;
+  }
+  if((size_t)(dash - text) >= sizeof(buffer))
+    return -1;
+  memcpy(buffer, text, dash - text);
+  buffer[dash - text] = 0;
+  char *last;
+  unsigned long offset = strtoul(dash + 1, &last, 16);
+  if(debugger_parse_address(buffer, start) || last == dash + 1 || *last || offset > 0xffffff)
+    return -1;
+  *end = (*start & 0xff000000) | offset;
+  return 0;
+}
+
+void debugger_describe_hit(struct debugger *d, char *buffer, size_t size) {
+  const char *region = physical_region_name(d->hit_physical);
+  uint32_t offset = PHYSICAL_OFFSET(d->hit_physical);
+  switch(d->hit) {
+    case DEBUG_BREAKPOINT:
+      snprintf(buffer, size, "breakpoint at %s:%06x (pc %.4x)", region, offset, d->hit_pc);
+      break;
+    case DEBUG_WATCH_READ:
+    case DEBUG_WATCH_WRITE:
+      snprintf(buffer, size, "%s of %.2x at %s:%06x (instruction at %.4x)", d->hit == DEBUG_WATCH_READ ? "read" : "write",
+        d->hit_value, region, offset, d->hit_pc);
+      break;
+    default:
+      snprintf(buffer, size, "running");
+      break;
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef MIUCHIZ_DEBUGGER_HEADER
+#define MIUCHIZ_DEBUGGER_HEADER
+#include "hardware.h"
+
+// Breakpoints and watchpoints are on physical_address()es, so they follow
+// the code or data around whatever bank it's mapped in through. Video is
+// addressed by CPU address, since it isn't memory.
+//
+// Nothing is checked while none are set. Once some are, cpu_state.debugger
+// makes run_cycles() use a separate loop that interprets one instruction
+// at a time and checks breakpoints, and watchpoints swap in bus handlers
+// that check each access, much like trace.h does. With a trace running
+// they go in underneath the trace's, so the trace still sees every access
+// and either can be turned off without undoing the other.
+
+#define DEBUG_BREAKPOINTS 32
+#define DEBUG_WATCHPOINTS 32
+
+#define WATCH_READ  1
+#define WATCH_WRITE 2
+
+// debugger.hit
+enum {
+  DEBUG_RUNNING,
+  DEBUG_BREAKPOINT,
+  DEBUG_WATCH_READ,
+  DEBUG_WATCH_WRITE
+};
+
+struct watchpoint {
+  uint32_t start, end; // physical addresses, inclusive, in the same region
+  int kind;            // WATCH_READ and/or WATCH_WRITE
+};
+
+struct debugger {
+  struct cpu_state *cpu;
+  struct miuchiz_hardware *hw;
+  uint32_t breakpoints[DEBUG_BREAKPOINTS];
+  int breakpoint_count;
+  struct watchpoint watchpoints[DEBUG_WATCHPOINTS];
+  int watchpoint_count;
+
+  // breakpoints per low byte of their address, which banking never changes,
+  // so most instructions don't need a physical_address()
+  uint8_t breakpoint_filter[256];
+  // WATCH_READ/WATCH_WRITE for each CPU page that might hit a watchpoint
+  // with the banks the pages were worked out for
+  uint8_t watch_pages[256];
+  uint16_t watch_BRR, watch_PRR, watch_DRR;
+  int fetching; // opcode and operand fetches aren't watched
+  uint16_t pc;  // of the instruction being run
+
+  // why the CPU stopped, and where; miuchiz_run() won't run until debugger_continue()
+  int hit;
+  uint16_t hit_pc;        // of the instruction that hit, which for breakpoints hasn't run yet
+  uint32_t hit_physical;  // the breakpoint or the watched address
+  uint8_t hit_value;      // read or written, for watchpoints
+  int resume;             // don't stop at the breakpoint it's continuing from
+  uint16_t resume_pc;
+
+  // what the debugger replaced
+  int installed, watching;
+  void *hardware;
+  void (*write)(void*, uint16_t, uint8_t);
+  uint8_t (*read)(void*, uint16_t);
+  int skip_idle;
+};
+
+void debugger_init(struct debugger *d, struct cpu_state *cpu, struct miuchiz_hardware *hw);
+int debugger_add_breakpoint(struct debugger *d, uint32_t physical);
+int debugger_add_watchpoint(struct debugger *d, uint32_t start, uint32_t end, int kind);
+void debugger_clear(struct debugger *d);
+void debugger_continue(struct debugger *d);
+int debugger_check_breakpoint(struct debugger *d, uint16_t pc);
+int debugger_parse_address(const char *text, uint32_t *physical);
+int debugger_parse_range(const char *text, uint32_t *start, uint32_t *end);
+void debugger_describe_hit(struct debugger *d, char *buffer, size_t size);
+#endif
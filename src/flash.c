@@ -0,0 +1,350 @@
+#include "flash.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The flash chip's commands, as on the usual JEDEC parts: two unlock
+// writes, then the command. Only the low address bits are decoded, so
+// both the $555/$2aa and $5555/$2aaa unlock addresses work. Programming
+// and erasing finish straight away, so status polling reads the data.
+// The IDs are a guess at an SST part and haven't been read off a real unit.
+
+#define FLASH_MANUFACTURER_ID 0xbf
+#define FLASH_DEVICE_ID       0xd7
+
+enum {
+  FLASH_READ,
+  FLASH_UNLOCK1,      // got $aa
+  FLASH_UNLOCK2,      // got $55, the next write is a command
+  FLASH_PROGRAM,      // the next write programs a byte
+  FLASH_ERASE,        // got $80, an erase needs unlocking again
+  FLASH_ERASE_UNLOCK1,
+  FLASH_ERASE_UNLOCK2 // the next write says what to erase
+};
+
+static void set_id_mode(struct miuchiz_hardware *hw, int on) {
+  if(hw->flash_id == on)
+    return;
+  hw->flash_id = on;
+  update_memory_map(hw);
+  end_slice(hw); // a block may be running out of flash
+}
+
+static void erase(struct miuchiz_hardware *hw, uint32_t start, uint32_t length) {
+  memset(&hw->image.flash[start], 0xff, length);
+  for(uint32_t page = start; page < start + length; page += 256)
+    mark_flash_dirty(hw, page);
+  flush_code_range(hw, &hw->image.flash[start], length);
+  end_slice(hw); // a block may be running out of what was erased
+}
+
+uint8_t flash_read(struct miuchiz_hardware *hw, uint32_t offset) {
+  if(hw->flash_id)
+    return (offset & 1) ? FLASH_DEVICE_ID : FLASH_MANUFACTURER_ID;
+  return hw->image.flash[offset];
+}
+
+void flash_write(struct miuchiz_hardware *hw, uint32_t offset, uint8_t value) {
+  uint32_t command_address = offset & 0x7ff;
+  // $f0 gets out of anything
+  if(value == 0xf0) {
+    hw->flash_state = FLASH_READ;
+    set_id_mode(hw, 0);
+    return;
+  }
+
+  switch(hw->flash_state) {
+    case FLASH_READ:
+    case FLASH_ERASE:
+      if(command_address == 0x555 && value == 0xaa) {
+        hw->flash_state = hw->flash_state == FLASH_ERASE ? FLASH_ERASE_UNLOCK1 : FLASH_UNLOCK1;
+        return;
+      }
+      break;
+    case FLASH_UNLOCK1:
+    case FLASH_ERASE_UNLOCK1:
+      if(command_address == 0x2aa && value == 0x55) {
+        hw->flash_state++;
+        return;
+      }
+      break;
+    case FLASH_UNLOCK2:
+      if(command_address != 0x555)
+        break;
+      if(value == 0xa0) {
+        hw->flash_state = FLASH_PROGRAM;
+        return;
+      } else if(value == 0x80) {
+        hw->flash_state = FLASH_ERASE;
+        return;
+      } else if(value == 0x90) {
+        hw->flash_state = FLASH_READ;
+        set_id_mode(hw, 1);
+        return;
+      }
+      break;
+    case FLASH_PROGRAM: {
+      // programming can only clear bits
+      uint8_t *byte = &hw->image.flash[offset];
+      if((*byte & value) != *byte) {
+        *byte &= value;
+        mark_flash_dirty(hw, offset);
+        flush_code_range(hw, &hw->image.flash[offset & ~0xff], 256);
+        end_slice(hw); // a block may be running out of this page
+      }
+      hw->flash_state = FLASH_READ;
+      return;
+    }
+    case FLASH_ERASE_UNLOCK2:
+      if(value == 0x30) {
+        erase(hw, offset & ~(MIUCHIZ_FLASH_SECTOR - 1), MIUCHIZ_FLASH_SECTOR);
+      } else if(value == 0x10 && command_address == 0x555) {
+        erase(hw, 0, MIUCHIZ_FLASH_SIZE);
+      }
+      hw->flash_state = FLASH_READ;
+      return;
+  }
+  // anything out of sequence goes back to reading
+  hw->flash_state = FLASH_READ;
+}
+
+// ------------------------------------------------------------------
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t length) {
+  for(size_t i=0; i<length; i++)
+    hash = (hash ^ data[i]) * 0x01000193;
+  return hash;
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+  for(int i=0; i<4; i++)
+    p[i] = value >> (i * 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int sync_file(FILE *file) {
+  if(fflush(file))
+    return -1;
+#ifndef _WIN32
+  return fsync(fileno(file));
+#else
+  return 0;
+#endif
+}
+
+// Applies every complete record, stopping at the first one that isn't,
+// which is where a crash cut the journal short
+static void replay(struct flash_journal *j, struct miuchiz_hardware *hw) {
+  uint8_t *record = j->record;
+  while(fread(record, 1, FLASH_JOURNAL_RECORD, j->file) == FLASH_JOURNAL_RECORD) {
+    uint32_t sector = get32(record);
+    uint32_t check = get32(record + 4 + MIUCHIZ_FLASH_SECTOR);
+    if(sector >= MIUCHIZ_FLASH_SECTORS || fnv1a(0x811c9dc5, record, 4 + MIUCHIZ_FLASH_SECTOR) != check)
+      break;
+    memcpy(&hw->image.flash[sector * MIUCHIZ_FLASH_SECTOR], record + 4, MIUCHIZ_FLASH_SECTOR);
+    for(int page = 0; page < MIUCHIZ_FLASH_SECTOR / 256; page++)
+      hw->image.flash_dirty[sector * (MIUCHIZ_FLASH_SECTOR / 256) + page] |= FLASH_PAGE_MODIFIED;
+    j->records++;
+  }
+}
+
+#ifndef _WIN32
+// So a rename in it survives a crash
+static int sync_directory(const char *path) {
+  char directory[1024];
+  const char *slash = strrchr(path, '/');
+  if(!slash)
+    strcpy(directory, ".");
+  else
+    snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path) + (slash == path), path);
+  int fd = open(directory, O_RDONLY);
+  if(fd < 0)
+    return -1;
+  int error = fsync(fd);
+  close(fd);
+  return error;
+}
+#endif
+
+// Writes j->saved out whole to a new image file, renames it over the old
+// one, then removes the journal, which has nothing the image doesn't. The
+// old file is never changed, so pages of it that are still mapped, like
+// image.flash_base, keep what they had, and a crash part way leaves the old
+// image and the journal.
+static int fold(struct flash_journal *j) {
+  char temp_path[sizeof(j->journal_path)];
+  snprintf(temp_path, sizeof(temp_path), "%s.new", j->image_path);
+  FILE *image = fopen(temp_path, "wb");
+  if(!image) {
+    printf("Can't open %s for writing, the journal is kept\n", temp_path);
+    return -1;
+  }
+  int error = fwrite(j->saved, 1, MIUCHIZ_FLASH_SIZE, image) != MIUCHIZ_FLASH_SIZE;
+  error |= sync_file(image);
+  error |= fclose(image) != 0;
+#ifdef _WIN32
+  // rename() won't replace a file here
+  if(!error)
+    remove(j->image_path);
+#endif
+  if(error || rename(temp_path, j->image_path)) {
+    remove(temp_path);
+    printf("Can't write %s, the journal is kept\n", j->image_path);
+    return -1;
+  }
+#ifndef _WIN32
+  if(sync_directory(j->image_path)) {
+    printf("Can't sync the directory of %s, the journal is kept\n", j->image_path);
+    return -1;
+  }
+#endif
+  if(j->file)
+    fclose(j->file);
+  j->file = NULL;
+  remove(j->journal_path);
+  j->records = 0;
+  j->fold = 0;
+  return 0;
+}
+
+// Starts an empty journal, replacing whatever was there
+static int start_journal(struct flash_journal *j) {
+  uint8_t header[12];
+  if(!(j->file = fopen(j->journal_path, "wb"))) {
+    printf("Can't open %s for writing\n", j->journal_path);
+    return -1;
+  }
+  memcpy(header, "MIUCHIZJ", 8);
+  put32(header + 8, FLASH_JOURNAL_VERSION);
+  fwrite(header, 1, sizeof(header), j->file);
+  return sync_file(j->file);
+}
+
+// Call after the images are loaded. A journal left over from a session
+// that didn't close it is replayed, and kept until the first
+// flash_journal_write() has folded it into the image. Nothing is written
+// here.
+int flash_journal_open(struct flash_journal *j, struct miuchiz_hardware *hw, const char *image_path) {
+  memset(j, 0, sizeof(*j));
+  if(!hw->image.flash || strlen(image_path) >= sizeof(j->image_path))
+    return -1;
+  strcpy(j->image_path, image_path);
+  snprintf(j->journal_path, sizeof(j->journal_path), "%s.journal", image_path);
+
+  uint8_t header[12];
+  FILE *old = fopen(j->journal_path, "rb");
+  if(old) {
+    j->file = old;
+    if(fread(header, 1, sizeof(header), old) == sizeof(header)
+      && !memcmp(header, "MIUCHIZJ", 8) && get32(header + 8) == FLASH_JOURNAL_VERSION)
+      replay(j, hw);
+    fclose(old);
+    j->file = NULL;
+    flush_code_blocks(hw);
+    j->fold = j->records > 0;
+    if(!j->fold)
+      remove(j->journal_path);
+  }
+  memcpy(j->saved, hw->image.flash, MIUCHIZ_FLASH_SIZE);
+  j->open = 1;
+  return 0;
+}
+
+// Copies every sector with unsaved changes into a record for
+// flash_journal_write(). Records that haven't been written yet are left
+// alone, and the sectors changed since wait for the next time. Returns
+// nonzero if flash_journal_write() has anything to do. Cheap when it
+// doesn't.
+int flash_journal_collect(struct flash_journal *j, struct miuchiz_hardware *hw) {
+  const int pages = MIUCHIZ_FLASH_SECTOR / 256;
+  if(!j->open || j->pending_count)
+    return j->open;
+  for(int sector = 0; sector < MIUCHIZ_FLASH_SECTORS; sector++) {
+    uint8_t *dirty = &hw->image.flash_dirty[sector * pages];
+    int unsaved = 0;
+    for(int page = 0; page < pages; page++)
+      unsaved |= dirty[page] & FLASH_PAGE_UNSAVED;
+    if(!unsaved)
+      continue;
+    uint8_t *record = j->pending[j->pending_count++];
+    put32(record, sector);
+    memcpy(record + 4, &hw->image.flash[sector * MIUCHIZ_FLASH_SECTOR], MIUCHIZ_FLASH_SECTOR);
+    put32(record + 4 + MIUCHIZ_FLASH_SECTOR, fnv1a(0x811c9dc5, record, 4 + MIUCHIZ_FLASH_SECTOR));
+    for(int page = 0; page < pages; page++)
+      dirty[page] &= ~FLASH_PAGE_UNSAVED;
+  }
+  return j->pending_count || j->fold;
+}
+
+// Appends the first count collected records to the journal
+static int append(struct flash_journal *j, int count) {
+  // one left over from last time is added to, a new one needs its header
+  if(!j->file && j->records && !(j->file = fopen(j->journal_path, "ab"))) {
+    printf("Can't open %s for writing\n", j->journal_path);
+    return -1;
+  }
+  if(!j->file && start_journal(j))
+    return -1;
+  for(int i = 0; i < count; i++) {
+    if(fwrite(j->pending[i], 1, FLASH_JOURNAL_RECORD, j->file) != FLASH_JOURNAL_RECORD) {
+      printf("Can't write %s\n", j->journal_path);
+      return -1;
+    }
+  }
+  j->records += count;
+  return sync_file(j->file);
+}
+
+// Saves the collected records and waits for them to reach the disk. They're
+// appended to the journal, unless it was left over from last time or would
+// go past FLASH_JOURNAL_LIMIT, in which case the image is rewritten with
+// everything instead. Doesn't look at the emulator at all.
+int flash_journal_write(struct flash_journal *j) {
+  if(!j->open)
+    return -1;
+  int count = j->pending_count;
+  j->pending_count = 0;
+  for(int i = 0; i < count; i++)
+    memcpy(&j->saved[get32(j->pending[i]) * MIUCHIZ_FLASH_SECTOR], j->pending[i] + 4, MIUCHIZ_FLASH_SECTOR);
+  if(j->fold || j->records + count > FLASH_JOURNAL_LIMIT) {
+    j->fold = 1;
+    if(!fold(j))
+      return 0;
+    // the journal still has to keep them until a fold works
+    if(count)
+      append(j, count);
+    return -1;
+  }
+  return count ? append(j, count) : 0;
+}
+
+// Both of the above, for when waiting on the disk doesn't matter
+int flash_journal_sync(struct flash_journal *j, struct miuchiz_hardware *hw) {
+  if(!j->open || flash_journal_write(j))
+    return -1;
+  flash_journal_collect(j, hw);
+  return flash_journal_write(j);
+}
+
+// Saves anything left and folds the journal into the image. This is the
+// only time the image is rewritten where anyone waits on it, and it's at
+// exit.
+int flash_journal_close(struct flash_journal *j, struct miuchiz_hardware *hw) {
+  if(!j->open)
+    return -1;
+  flash_journal_collect(j, hw);
+  if(j->records || j->pending_count)
+    j->fold = 1;
+  int error = flash_journal_write(j);
+  if(j->file)
+    fclose(j->file);
+  j->file = NULL;
+  j->open = 0;
+  return error;
+}
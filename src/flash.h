@@ -0,0 +1,46 @@
+#ifndef MIUCHIZ_FLASH_HEADER
+#define MIUCHIZ_FLASH_HEADER
+#include "hardware.h"
+#include <stdio.h>
+
+// Keeps what the firmware writes to flash, without rewriting the image
+// every time. Changed sectors are appended to a journal next to the image,
+// each with a checksum, so a record cut short by a crash is just ignored.
+// Once the journal has FLASH_JOURNAL_LIMIT records, or one is left over
+// from a session that didn't close it, the next write folds it into the
+// image instead, by renaming a new copy over it, and the journal is only
+// removed after that. A crash at any point leaves either the journal or
+// the image with the latest copy of every sector.
+//
+// Journal files are "MIUCHIZJ", u32 version, then records of u32 sector
+// number, MIUCHIZ_FLASH_SECTOR bytes and a u32 FNV-1a of both, little endian.
+//
+// flash_journal_sync() is flash_journal_collect() and then
+// flash_journal_write(). The first is a quick copy that has to happen
+// where the emulator runs, but the second does all the waiting on the
+// disk, so it can be done on another thread while the emulator carries
+// on, as long as nothing is collected until it's finished.
+
+#define FLASH_JOURNAL_VERSION 1
+#define FLASH_JOURNAL_RECORD (4 + MIUCHIZ_FLASH_SECTOR + 4)
+#define FLASH_JOURNAL_LIMIT 256 // records, 1MB, before it's folded into the image
+
+struct flash_journal {
+  FILE *file;
+  char image_path[1024];
+  char journal_path[1040];
+  int open;
+  int records; // in the journal file
+  int fold;    // the next write folds the journal into the image
+  uint8_t record[FLASH_JOURNAL_RECORD]; // the one being read
+  uint8_t pending[MIUCHIZ_FLASH_SECTORS][FLASH_JOURNAL_RECORD]; // collected, not written yet
+  int pending_count;
+  uint8_t saved[MIUCHIZ_FLASH_SIZE]; // flash as the image and journal have it
+};
+
+int flash_journal_open(struct flash_journal *j, struct miuchiz_hardware *hw, const char *image_path);
+int flash_journal_collect(struct flash_journal *j, struct miuchiz_hardware *hw);
+int flash_journal_write(struct flash_journal *j);
+int flash_journal_sync(struct flash_journal *j, struct miuchiz_hardware *hw);
+int flash_journal_close(struct flash_journal *j, struct miuchiz_hardware *hw);
+#endif
@@ -0,0 +1,573 @@
+#include "hardware.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+uint8_t video_read(struct miuchiz_hardware *hw, uint16_t address) {
+  if(address & 1) { // data
+    return 0xff;
+  } else {          // control
+    return 0xca;
+  }
+}
+
+void video_write(struct miuchiz_hardware *hw, uint16_t address, uint8_t value) {
+  if(address & 1) { // data
+    // write a pixel
+    if((hw->cursor_odd & 1) == 0) {
+      hw->pixel_buffer = value;
+    } else {
+      hw->pixels[hw->cursor_y][hw->cursor_x] = (hw->pixel_buffer << 8) | value;
+      hw->cursor_x++;
+      if(hw->cursor_x >= MIUCHIZ_WIDTH) {
+        hw->cursor_x = 0;
+        hw->cursor_y++;
+      }
+      if(hw->cursor_y >= MIUCHIZ_HEIGHT) {
+        hw->cursor_y = 0;
+      }
+    }
+
+    hw->cursor_odd ^= 1;
+  } else {          // control
+    // do nothing
+  }
+}
+
+enum {
+  MAP_NONE,
+  MAP_RAM,
+  MAP_OTP,
+  MAP_VIDEO,
+  MAP_FLASH
+};
+
+// Works out what an address points at with the current bank registers
+static int decode_address(struct miuchiz_hardware *hw, uint16_t address, uint8_t **pointer) {
+  // the I/O registers, see io_read() and io_write()
+  if(address < 0x0080)
+    return MAP_NONE;
+  // fixed bank of RAM
+  if(address >= 0x0080 && address <= 0x1fff) {
+    *pointer = &hw->ram[address];
+    return MAP_RAM;
+  }
+
+  int bank = 0, is_ram = 0, offset = 0;
+  if(address >= 0x2000 && address <= 0x3fff) {
+    bank = hw->BRR;
+    is_ram = hw->BRR & 0x8000;
+    offset = address & 0x1fff;
+  }
+  else if(address >= 0x4000 && address <= 0x7fff) {
+    bank = (hw->PRR << 1) & 0x7fff;
+    is_ram = hw->PRR & 0x8000;
+    offset = address & 0x3fff;
+  }
+  else if(address >= 0x8000 && address <= 0xffff) {
+    bank = (hw->DRR << 2) & 0x7fff;
+    is_ram = hw->DRR & 0x8000;
+    offset = address & 0x7fff;
+  }
+
+  if(is_ram) {
+    *pointer = &hw->ram[address & 0x7fff];
+    return MAP_RAM;
+  }
+  if(!hw->image.otp || !hw->image.flash)
+    return MAP_NONE;
+  if(((bank & 0x9e00) == 0x0000) || ((bank & 0x9e00) == 0x1e00)) {
+    *pointer = &hw->image.otp[((bank&1)*8192+offset) & 0x3fff];
+    return MAP_OTP;
+  } else if((bank & 0x9f00) == 0x0300) {
+    return MAP_VIDEO;
+  } else if((bank & 0x9c00) == 0x0400) {
+    int flash_address = ((bank&0xff)*8192+offset) & 0x1fffff;
+    *pointer = &hw->image.flash[flash_address];
+    return MAP_FLASH;
+  }
+  return MAP_NONE;
+}
+
+// Rebuilds the page tables, must be called whenever BRR, PRR or DRR change
+void update_memory_map(struct miuchiz_hardware *hw) {
+  // page zero is RAM above the I/O registers, which miuchiz_read() and
+  // miuchiz_write() send to the handlers before looking at the map
+  hw->read_map[0] = hw->ram;
+  hw->write_map[0] = hw->ram;
+  hw->code_map[0] = NULL;
+
+  for(int page = 1; page < 256; page++) {
+    uint8_t *pointer = NULL;
+    switch(decode_address(hw, page << 8, &pointer)) {
+      case MAP_RAM:
+        hw->read_map[page] = pointer;
+        hw->write_map[page] = pointer;
+        hw->code_map[page] = NULL;
+        break;
+      case MAP_OTP:
+        // writes are ignored
+        hw->read_map[page] = pointer;
+        hw->write_map[page] = hw->write_sink;
+        hw->code_map[page] = pointer;
+        break;
+      case MAP_FLASH:
+        // writes are commands for the flash chip, and in ID mode so are reads
+        hw->read_map[page] = hw->flash_id ? NULL : pointer;
+        hw->write_map[page] = NULL;
+        hw->code_map[page] = hw->flash_id ? NULL : pointer;
+        break;
+      default:
+        hw->read_map[page] = NULL;
+        hw->write_map[page] = NULL;
+        hw->code_map[page] = NULL;
+        break;
+    }
+  }
+}
+
+// I/O registers, laid out like the ST2205U's as far as they're understood.
+// Each one has its own read and write handler in io_registers[], and any
+// left out are plain storage in io.regs, so the firmware reads back what
+// it wrote to ports and LCD control.
+
+static uint8_t psg_period_read(struct miuchiz_hardware *hw, uint8_t address) { // PSG0L-PSG3H
+  return hw->io.psg_period[(address - 0x10) >> 1] >> ((address & 1) * 8);
+}
+
+static uint8_t psg_volume_read(struct miuchiz_hardware *hw, uint8_t address) { // VOLL, VOLH
+  return hw->io.psg_volume[address - 0x18];
+}
+
+static uint8_t psgc_read(struct miuchiz_hardware *hw, uint8_t address) {
+  return hw->io.psgc;
+}
+
+static uint8_t psgm_read(struct miuchiz_hardware *hw, uint8_t address) {
+  return hw->io.psgm;
+}
+
+// the sound up to now was made with the old settings, so these bring it up
+// to date first. Sound isn't the scheduler's business, the slice goes on.
+static void psg_period_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  uint16_t *period = &hw->io.psg_period[(address - 0x10) >> 1];
+  sound_update(hw);
+  *period = (address & 1) ? (*period & 0x00ff) | (value << 8) : (*period & 0xff00) | value;
+}
+
+static void psg_volume_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  sound_update(hw);
+  hw->io.psg_volume[address - 0x18] = value;
+}
+
+static void psgc_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  sound_update(hw);
+  hw->io.psgc = value & ((1 << MIUCHIZ_PSG_CHANNELS) - 1);
+}
+
+static void psgm_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  sound_update(hw);
+  hw->io.psgm = value & ((1 << MIUCHIZ_PSG_CHANNELS) - 1);
+}
+
+static uint8_t timer_read(struct miuchiz_hardware *hw, uint8_t address) { // T0CL-T3CH
+  return hw->io.timer_reload[(address - 0x20) >> 1] >> ((address & 1) * 8);
+}
+
+static uint8_t tien_read(struct miuchiz_hardware *hw, uint8_t address) {
+  return hw->io.tien;
+}
+
+static uint8_t bten_read(struct miuchiz_hardware *hw, uint8_t address) {
+  return hw->io.bten;
+}
+
+static uint8_t ireq_read(struct miuchiz_hardware *hw, uint8_t address) { // IREQL, IREQH
+  return hw->io.ireq >> ((address & 1) * 8);
+}
+
+static uint8_t iena_read(struct miuchiz_hardware *hw, uint8_t address) { // IENAL, IENAH
+  return hw->io.iena >> ((address & 1) * 8);
+}
+
+// timers and interrupts are the scheduler's business, so these let it look again
+static void timer_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  int timer = (address - 0x20) >> 1;
+  uint16_t *reload = &hw->io.timer_reload[timer];
+  if(address & 1) {
+    *reload = (*reload & 0x00ff) | (value << 8);
+    // writing the high byte starts a new period
+    update_timers(hw, 1 << timer);
+  } else {
+    *reload = (*reload & 0xff00) | value;
+  }
+  end_slice(hw);
+}
+
+static void tien_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  hw->io.tien = value & ((1 << MIUCHIZ_TIMERS) - 1);
+  update_timers(hw, 0);
+  end_slice(hw);
+}
+
+static void bten_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  hw->io.bten = value;
+  update_timers(hw, 1 << MIUCHIZ_TIMERS);
+  end_slice(hw);
+}
+
+// writing 0 to a bit clears that request, 1 leaves it alone
+static void ireq_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  int shift = (address & 1) * 8;
+  hw->io.ireq &= (value << shift) | (0xff00 >> shift);
+  end_slice(hw);
+}
+
+static void iena_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  int shift = (address & 1) * 8;
+  hw->io.iena = (hw->io.iena & (0xff00 >> shift)) | (value << shift);
+  end_slice(hw);
+}
+
+// PRRL/H, DRRL/H and BRRL/H, in that order from $32
+static uint16_t *bank_register(struct miuchiz_hardware *hw, uint8_t address) {
+  switch(address >> 1) {
+    case 0x32 >> 1: return &hw->PRR;
+    case 0x34 >> 1: return &hw->DRR;
+    default:        return &hw->BRR;
+  }
+}
+
+static uint8_t bank_read(struct miuchiz_hardware *hw, uint8_t address) {
+  return *bank_register(hw, address) >> ((address & 1) * 8);
+}
+
+static void bank_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  uint16_t *bank = bank_register(hw, address);
+  int shift = (address & 1) * 8;
+  *bank = (*bank & (0xff00 >> shift)) | (value << shift);
+  update_memory_map(hw);
+  end_slice(hw); // a block may be running out of the old bank
+}
+
+struct io_register {
+  uint8_t (*read)(struct miuchiz_hardware *hw, uint8_t address);
+  void (*write)(struct miuchiz_hardware *hw, uint8_t address, uint8_t value);
+};
+
+#define IO_PAIR(first, r, w) [first] = {r, w}, [(first) + 1] = {r, w}
+
+static const struct io_register io_registers[0x80] = {
+  IO_PAIR(0x10, psg_period_read, psg_period_write), // PSG0L-PSG3H
+  IO_PAIR(0x12, psg_period_read, psg_period_write),
+  IO_PAIR(0x14, psg_period_read, psg_period_write),
+  IO_PAIR(0x16, psg_period_read, psg_period_write),
+  IO_PAIR(0x18, psg_volume_read, psg_volume_write), // VOLL, VOLH
+  [0x1a] = {psgc_read, psgc_write},                 // PSGC
+  [0x1b] = {psgm_read, psgm_write},                 // PSGM
+  IO_PAIR(0x20, timer_read, timer_write),           // T0CL-T3CH
+  IO_PAIR(0x22, timer_read, timer_write),
+  IO_PAIR(0x24, timer_read, timer_write),
+  IO_PAIR(0x26, timer_read, timer_write),
+  [0x28] = {tien_read, tien_write},                 // TIEN
+  [0x2a] = {bten_read, bten_write},                 // BTEN
+  IO_PAIR(0x32, bank_read, bank_write),             // PRRL, PRRH
+  IO_PAIR(0x34, bank_read, bank_write),             // DRRL, DRRH
+  IO_PAIR(0x36, bank_read, bank_write),             // BRRL, BRRH
+  IO_PAIR(0x3c, ireq_read, ireq_write),             // IREQL, IREQH
+  IO_PAIR(0x3e, iena_read, iena_write),             // IENAL, IENAH
+};
+
+static uint8_t io_read(struct miuchiz_hardware *hw, uint8_t address) {
+  const struct io_register *r = &io_registers[address];
+  return r->read ? r->read(hw, address) : hw->io.regs[address];
+}
+
+static void io_write(struct miuchiz_hardware *hw, uint8_t address, uint8_t value) {
+  const struct io_register *r = &io_registers[address];
+  if(r->write)
+    r->write(hw, address, value);
+  else
+    hw->io.regs[address] = value;
+}
+
+// Where an address points with the current banks, as an offset into RAM,
+// OTP or flash. Anything else is left as the CPU address.
+uint32_t physical_address(struct miuchiz_hardware *hw, uint16_t address) {
+  uint8_t *pointer = NULL;
+  int map = decode_address(hw, address, &pointer);
+  uint32_t offset = address;
+  if(map == MAP_RAM)
+    offset = pointer - hw->ram;
+  else if(map == MAP_OTP)
+    offset = pointer - hw->image.otp;
+  else if(map == MAP_FLASH)
+    offset = pointer - hw->image.flash;
+  return (map << 24) | offset;
+}
+
+const char *physical_region_name(uint32_t physical) {
+  static const char *names[] = {"none", "ram", "otp", "video", "flash"};
+  int map = physical >> 24;
+  return map <= MAP_FLASH ? names[map] : "?";
+}
+
+// Forgets all predecoded code, for when OTP or flash change underneath it
+void flush_code_blocks(struct miuchiz_hardware *hw) {
+  for(int i=0; i<BLOCK_CACHE_SIZE; i++)
+    hw->blocks[i].key = NULL;
+}
+
+// Forgets predecoded code in part of OTP or flash. Blocks never cross a
+// page, so page aligned ranges catch every block that overlaps them.
+void flush_code_range(struct miuchiz_hardware *hw, const uint8_t *start, size_t length) {
+  for(int i=0; i<BLOCK_CACHE_SIZE; i++)
+    if(hw->blocks[i].key >= start && hw->blocks[i].key < start + length)
+      hw->blocks[i].key = NULL;
+}
+
+uint8_t slow_read(struct miuchiz_hardware *hw, uint16_t address) {
+  uint8_t *pointer = NULL;
+  if(address < 0x80)
+    return hw->read_value = io_read(hw, address);
+  switch(decode_address(hw, address, &pointer)) {
+    case MAP_RAM:
+    case MAP_OTP:
+      hw->read_value = *pointer;
+      break;
+    case MAP_FLASH:
+      hw->read_value = flash_read(hw, pointer - hw->image.flash);
+      break;
+    case MAP_VIDEO:
+      hw->read_value = video_read(hw, address);
+      break;
+  }
+  return hw->read_value;
+}
+
+void slow_write(struct miuchiz_hardware *hw, uint16_t address, uint8_t value) {
+  uint8_t *pointer = NULL;
+  if(address < 0x80) {
+    io_write(hw, address, value);
+    return;
+  }
+  switch(decode_address(hw, address, &pointer)) {
+    case MAP_RAM:
+      *pointer = value;
+      break;
+    case MAP_FLASH:
+      flash_write(hw, pointer - hw->image.flash, value);
+      break;
+    case MAP_VIDEO:
+      video_write(hw, address, value);
+      break;
+  }
+}
+
+uint8_t read_handler(void *h, uint16_t address) {
+  return miuchiz_read(h, address);
+}
+
+void write_handler(void *h, uint16_t address, uint8_t value) {
+  miuchiz_write(h, address, value);
+}
+
+void miuchiz_reset(struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  // the images and sound rate stay across a reset, so hw must start out zeroed
+  struct miuchiz_images image = hw->image;
+  uint32_t sound_rate = hw->sound.rate;
+  memset(cpu, 0, sizeof(*cpu));
+  memset(hw, 0, sizeof(*hw));
+  hw->image = image;
+  sound_set_rate(hw, sound_rate);
+
+  cpu->hardware = hw;
+  cpu->read = read_handler;
+  cpu->write = write_handler;
+  cpu_set_flags(cpu, 0);
+  cpu->skip_idle = 1;
+  cpu->open_bus = &hw->read_value;
+  cpu->code_map = hw->code_map;
+  cpu->blocks = hw->blocks;
+  hw->PRR = 0x7202;
+  hw->BRR = 0xe000;
+  hw->DRR = 0x78c0;
+  cpu->pc = 0x4000;
+  cpu->s = 0xff;
+  hw->cpu = cpu;
+  update_memory_map(hw);
+  reset_scheduler(hw);
+}
+
+// Maps an image copy-on-write so only the pages the CPU touches get read in,
+// and anything the emulator writes stays private to this process. Where
+// mapping fails the file is read into a buffer instead, and a file too
+// short to fill the image fails either way.
+static uint8_t *load_image(const char *path, size_t size, int *mapped) {
+  *mapped = 0;
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size >= (off_t)size) {
+    void *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image != MAP_FAILED) {
+      *mapped = 1;
+      return image;
+    }
+  } else {
+    close(fd);
+  }
+#endif
+
+  FILE *file = fopen(path, "rb");
+  if(file == NULL)
+    return NULL;
+  uint8_t *image = malloc(size);
+  if(image && fread(image, 1, size, file) != size) {
+    free(image);
+    image = NULL;
+  }
+  fclose(file);
+  return image;
+}
+
+// Copies an image from memory, zero-filling anything past the end of it
+static uint8_t *copy_image(const void *data, size_t data_size, size_t size) {
+  uint8_t *image = calloc(1, size);
+  if(image)
+    memcpy(image, data, data_size < size ? data_size : size);
+  return image;
+}
+
+static void unload_image(uint8_t *image, size_t size, int mapped) {
+  if(!image)
+    return;
+#ifndef _WIN32
+  if(mapped) {
+    munmap(image, size);
+    return;
+  }
+#endif
+  free(image);
+}
+
+void miuchiz_unload_images(struct miuchiz_hardware *hw) {
+  struct miuchiz_images *image = &hw->image;
+  unload_image(image->otp, MIUCHIZ_OTP_SIZE, image->otp_mapped);
+  unload_image(image->flash, MIUCHIZ_FLASH_SIZE, image->flash_mapped);
+  unload_image(image->flash_base, MIUCHIZ_FLASH_SIZE, image->flash_base_mapped);
+  memset(image, 0, sizeof(*image));
+  flush_code_blocks(hw);
+  update_memory_map(hw);
+}
+
+int miuchiz_load_images(struct miuchiz_hardware *hw, const char *otp_path, const char *flash_path) {
+  miuchiz_unload_images(hw);
+
+  struct miuchiz_images *image = &hw->image;
+  image->otp = load_image(otp_path, MIUCHIZ_OTP_SIZE, &image->otp_mapped);
+  if(image->otp == NULL)
+    return MIUCHIZ_BAD_OTP;
+
+  image->flash = load_image(flash_path, MIUCHIZ_FLASH_SIZE, &image->flash_mapped);
+  // a second untouched copy, which costs nothing until a save state needs it
+  image->flash_base = load_image(flash_path, MIUCHIZ_FLASH_SIZE, &image->flash_base_mapped);
+  if(image->flash == NULL || image->flash_base == NULL) {
+    miuchiz_unload_images(hw);
+    return MIUCHIZ_BAD_FLASH;
+  }
+
+  update_memory_map(hw);
+  return 0;
+}
+
+int miuchiz_load_images_from_memory(struct miuchiz_hardware *hw, const void *otp, size_t otp_size, const void *flash, size_t flash_size) {
+  miuchiz_unload_images(hw);
+
+  struct miuchiz_images *image = &hw->image;
+  image->otp = copy_image(otp, otp_size, MIUCHIZ_OTP_SIZE);
+  image->flash = copy_image(flash, flash_size, MIUCHIZ_FLASH_SIZE);
+  image->flash_base = copy_image(flash, flash_size, MIUCHIZ_FLASH_SIZE);
+  if(!image->otp || !image->flash || !image->flash_base) {
+    miuchiz_unload_images(hw);
+    return -1;
+  }
+
+  update_memory_map(hw);
+  return 0;
+}
+
+// FNV-1a over the LCD contents, so headless runs can be compared.
+// Goes column by column so hashes match the ones from older builds.
+uint64_t miuchiz_pixel_hash(struct miuchiz_hardware *hw) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(int x = 0; x < MIUCHIZ_WIDTH; x++) {
+    for(int y = 0; y < MIUCHIZ_HEIGHT; y++) {
+      uint16_t pixel = hw->pixels[y][x];
+      hash = (hash ^ (pixel & 0xff)) * 0x100000001b3ULL;
+      hash = (hash ^ (pixel >> 8)) * 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+// FNV-1a over flash as it was loaded, which save states keep so they're
+// only ever loaded on top of the image they were made from. Reading all of
+// flash_base in is slow, so it's only worked out once.
+uint64_t miuchiz_flash_base_hash(struct miuchiz_hardware *hw) {
+  struct miuchiz_images *image = &hw->image;
+  if(!image->flash_base || image->base_hash)
+    return image->base_hash;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(size_t i = 0; i < MIUCHIZ_FLASH_SIZE; i++)
+    hash = (hash ^ image->flash_base[i]) * 0x100000001b3ULL;
+  image->base_hash = hash;
+  return hash;
+}
+
+// Expands 0x0RGB into 0xFFRRGGBB; spreading the nibbles apart lets one
+// shift and OR duplicate all three of them at once
+static inline uint32_t pixel_to_argb(uint16_t pixel) {
+  uint32_t spread = ((pixel & 0xf00) << 8) | ((pixel & 0x0f0) << 4) | (pixel & 0x00f);
+  return 0xff000000 | spread | (spread << 4);
+}
+
+// Converts the LCD into 32-bit pixels, pitch is in bytes
+void miuchiz_pixels_to_argb(struct miuchiz_hardware *hw, uint32_t *dest, int pitch) {
+  for(int y = 0; y < MIUCHIZ_HEIGHT; y++) {
+    const uint16_t *source = hw->pixels[y];
+    uint32_t *row = (uint32_t*)((uint8_t*)dest + y * pitch);
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i red = _mm_set1_epi32(0xf00), green = _mm_set1_epi32(0x0f0), blue = _mm_set1_epi32(0x00f);
+    for(; x + 8 <= MIUCHIZ_WIDTH; x += 8) {
+      __m128i in = _mm_loadu_si128((const __m128i*)(source + x));
+      __m128i half[2] = {_mm_unpacklo_epi16(in, zero), _mm_unpackhi_epi16(in, zero)};
+      for(int i = 0; i < 2; i++) {
+        __m128i spread = _mm_or_si128(_mm_or_si128(
+          _mm_slli_epi32(_mm_and_si128(half[i], red), 8),
+          _mm_slli_epi32(_mm_and_si128(half[i], green), 4)),
+          _mm_and_si128(half[i], blue));
+        __m128i out = _mm_or_si128(_mm_or_si128(spread, _mm_slli_epi32(spread, 4)), alpha);
+        _mm_storeu_si128((__m128i*)(row + x + i * 4), out);
+      }
+    }
+#endif
+    for(; x < MIUCHIZ_WIDTH; x++)
+      row[x] = pixel_to_argb(source[x]);
+  }
+}
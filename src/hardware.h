@@ -0,0 +1,286 @@
+#ifndef MIUCHIZ_HARDWARE_HEADER
+#define MIUCHIZ_HARDWARE_HEADER
+#include <stdint.h>
+#include <stddef.h>
+
+#define MIUCHIZ_WIDTH 98
+#define MIUCHIZ_HEIGHT 67
+// Clock speed is a guess, it has not been measured on a real unit yet
+#define MIUCHIZ_CPU_CLOCK 4000000
+#define MIUCHIZ_FRAME_RATE 60
+#define MIUCHIZ_FLASH_SIZE (1024 * 1024 * 2)
+#define MIUCHIZ_OTP_SIZE 0x4000
+#define MIUCHIZ_FLASH_PAGES (MIUCHIZ_FLASH_SIZE / 256)
+#define MIUCHIZ_FLASH_SECTOR 4096 // smallest amount the flash chip can erase
+#define MIUCHIZ_FLASH_SECTORS (MIUCHIZ_FLASH_SIZE / MIUCHIZ_FLASH_SECTOR)
+#define MIUCHIZ_CYCLES_PER_FRAME (MIUCHIZ_CPU_CLOCK / MIUCHIZ_FRAME_RATE)
+
+#define FLAG_CARRY    1
+#define FLAG_ZERO     2
+#define FLAG_NO_IRQ   4
+#define FLAG_DECIMAL  8
+#define FLAG_BREAK    16
+#define FLAG_OVERFLOW 64
+#define FLAG_NEGATIVE 128
+
+// cpu_state.waiting
+#define CPU_WAITING 1 // WAI, an interrupt request wakes it up
+#define CPU_STOPPED 2 // STP, only a reset gets out of this
+
+#define IDLE_LOOP_SLOTS 16
+#define BLOCK_CACHE_SIZE 1024 // must be a power of two
+#define BLOCK_LENGTH 16       // most instructions in one block
+
+struct cpu_state;
+
+// One predecoded instruction
+struct block_op {
+  void (*handler)(struct cpu_state *s);
+  uint8_t operand[2];
+  uint8_t last_byte; // last byte the instruction fetches, for open bus
+  uint8_t length;
+  uint8_t cycles;
+};
+
+// A straight run of instructions from OTP or flash, ending at the first one
+// that can jump, at the end of a page, or after BLOCK_LENGTH instructions
+struct code_block {
+  const uint8_t *key; // host address of the first opcode, NULL if unused
+  int count;
+  struct block_op ops[BLOCK_LENGTH];
+};
+
+// A polling loop that got fast-forwarded, see idle_loop_check() in cpu.c
+struct idle_loop {
+  uint16_t start, end; // first byte of the loop, and just past its branch
+  int cycles;          // cycles per trip around it
+  uint64_t skips;      // times it was fast-forwarded
+  uint64_t skipped;    // cycles skipped in total
+};
+
+struct cpu_state {
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t s;
+  uint8_t flags;    // I and D; N, V, Z and C are kept apart below, see cpu_get_flags()
+  uint16_t nz;      // last result: Z if the low byte is 0, N if bit 7 or 8 is set
+  uint8_t overflow; // V is bit 7
+  uint8_t carry;    // 0 or 1
+  uint16_t pc;
+  int waiting;
+  int cycles; // relative to the end of the current run_cycles() slice
+  void *hardware;
+  void (*write)(void*, uint16_t, uint8_t);
+  uint8_t (*read)(void*, uint16_t);
+
+  const uint8_t *operand; // operand bytes of the current instruction
+  uint8_t fetched[2];     // operand bytes fetched by run_instruction()
+  uint8_t *open_bus;      // set to the last byte fetched from a block
+  uint8_t **code_map;     // host pointers to pages that can't change, or NULL
+  struct code_block *blocks; // BLOCK_CACHE_SIZE of them, indexed by a hash
+  const void *block_handlers; // opcode table the cached blocks were decoded with
+
+  struct profiler *profiler; // see profiler.h, NULL when not profiling
+  struct trace_buffer *trace; // see trace.h, NULL when not tracing
+  struct debugger *debugger;  // see debugger.h, NULL with no breakpoints or watchpoints
+  int skip_idle; // fast-forward through polling loops
+  struct {
+    int armed, rejected;
+    uint16_t end;
+    uint8_t a, x, y, s, flags;
+    int cycles;
+  } idle; // the last loop branch taken, for spotting polling loops
+  struct idle_loop idle_loops[IDLE_LOOP_SLOTS]; // statistics
+};
+
+#define LAZY_FLAGS (FLAG_NEGATIVE | FLAG_OVERFLOW | FLAG_ZERO | FLAG_CARRY)
+
+// The processor status register, put back together from its pieces
+static inline uint8_t cpu_get_flags(const struct cpu_state *s) {
+  return (s->flags & ~LAZY_FLAGS) | ((s->nz & 0x180) ? FLAG_NEGATIVE : 0) | (s->overflow & 0x80 ? FLAG_OVERFLOW : 0) |
+    ((s->nz & 0xff) ? 0 : FLAG_ZERO) | s->carry;
+}
+
+static inline void cpu_set_flags(struct cpu_state *s, uint8_t flags) {
+  s->flags = flags & ~LAZY_FLAGS;
+  s->nz = ((flags & FLAG_ZERO) ? 0 : 1) | ((flags & FLAG_NEGATIVE) << 1);
+  s->overflow = (flags & FLAG_OVERFLOW) << 1;
+  s->carry = flags & FLAG_CARRY;
+}
+
+// flash_dirty flags for each 256 byte page of flash
+#define FLASH_PAGE_MODIFIED 1 // differs from the image file
+#define FLASH_PAGE_WRITTEN  2 // written since the last save state
+#define FLASH_PAGE_UNSAVED  4 // not in the flash journal yet, see flash.h
+
+// ROM images, which are kept across a reset
+struct miuchiz_images {
+  uint8_t *flash;      // MIUCHIZ_FLASH_SIZE bytes, see miuchiz_load_images()
+  uint8_t *flash_base; // flash as it is in the file, for save states
+  uint8_t *otp;        // MIUCHIZ_OTP_SIZE bytes
+  int flash_mapped, flash_base_mapped, otp_mapped;
+  uint64_t base_hash;  // see miuchiz_flash_base_hash(), 0 until worked out
+  uint8_t flash_dirty[MIUCHIZ_FLASH_PAGES];
+  uint32_t flash_writes; // goes up whenever flash changes, see rewind.c
+};
+
+// IREQ/IENA bits
+#define IRQ_BASE_TIMER 0x0001
+#define IRQ_TIMER0     0x0002 // timer n is IRQ_TIMER0 << n
+#define IRQ_LCD_FRAME  0x0020
+
+#define MIUCHIZ_TIMERS 4
+#define MIUCHIZ_PSG_CHANNELS 4
+
+// I/O registers in page zero
+struct miuchiz_io {
+  uint16_t ireq; // pending interrupt requests
+  uint16_t iena; // enabled interrupt requests
+  uint16_t timer_reload[MIUCHIZ_TIMERS];
+  uint8_t tien;  // bit n runs timer n
+  uint8_t bten;  // base timer rates
+  uint8_t nmi;   // an NMI is pending
+  uint16_t psg_period[MIUCHIZ_PSG_CHANNELS]; // see sound.c
+  uint8_t psg_volume[2]; // a nibble per channel
+  uint8_t psgc;  // bit n turns channel n on
+  uint8_t psgm;  // bit n plays channel n's low period byte as a sample
+  uint8_t regs[0x80]; // registers that are only stored, like ports and LCD control
+};
+
+#define SOUND_BUFFER 4096 // samples the frontend hasn't taken yet
+
+// Sound output, which isn't part of the emulated state
+struct miuchiz_sound {
+  uint32_t rate;           // samples per second, 0 to not generate any
+  uint64_t time;           // cycle count sound has been generated up to
+  uint32_t cycles_per_sample; // 16.16 fixed point
+  uint32_t remainder;      // fraction of a sample's cycles already gone by
+  uint64_t phase[MIUCHIZ_PSG_CHANNELS]; // 16.16 cycles into the current half wave
+  uint8_t level;           // bit n is channel n's square wave output
+  int16_t samples[SOUND_BUFFER];
+  int count;
+};
+
+enum {
+  EVENT_LCD_FRAME,
+  EVENT_BASE_TIMER,
+  EVENT_TIMER0,
+  EVENT_COUNT = EVENT_TIMER0 + MIUCHIZ_TIMERS
+};
+
+struct miuchiz_event {
+  uint64_t time;
+  int type;
+};
+
+// Things that happen at a set time, see scheduler.c
+struct miuchiz_scheduler {
+  uint64_t time; // absolute cycle count when cpu->cycles is zero
+  struct miuchiz_event queue[EVENT_COUNT]; // binary heap ordered by time
+  int count;     // each type is in the queue at most once
+};
+
+struct miuchiz_hardware {
+  uint8_t ram[0x8000]; // 32KB
+  uint16_t BRR; // bios bank
+  uint16_t PRR; // program bank
+  uint16_t DRR; // data bank
+  int cursor_x;
+  int cursor_y;
+  int cursor_odd;
+  struct miuchiz_images image;
+
+  uint8_t read_value; // last read value, for open bus
+  uint8_t pixel_buffer;
+  uint16_t pixels[MIUCHIZ_HEIGHT][MIUCHIZ_WIDTH]; // row-major, 0x0RGB
+
+  // host pointer for each 256 byte page of the CPU's address space, with
+  // NULL for pages that need a handler; see update_memory_map(). The I/O
+  // registers at $00-$7f always need one, whatever page zero points at.
+  uint8_t *read_map[256];
+  uint8_t *write_map[256];
+  uint8_t write_sink[256]; // ignored writes to OTP and flash go here
+  // like read_map, but only for the OTP and flash pages whose code can be
+  // cached; RAM is always interpreted
+  uint8_t *code_map[256];
+  struct code_block blocks[BLOCK_CACHE_SIZE];
+
+  struct miuchiz_io io;
+  struct miuchiz_scheduler scheduler;
+  struct miuchiz_sound sound;
+  struct cpu_state *cpu; // for the scheduler's current time
+
+  uint8_t flash_state; // how far into a command the flash chip is, see flash.c
+  uint8_t flash_id;    // reading flash gives the chip's ID instead
+};
+
+// anything that changes the contents of flash has to call this
+static inline void mark_flash_dirty(struct miuchiz_hardware *hw, uint32_t address) {
+  hw->image.flash_dirty[(address & (MIUCHIZ_FLASH_SIZE-1)) >> 8] |= FLASH_PAGE_MODIFIED | FLASH_PAGE_WRITTEN | FLASH_PAGE_UNSAVED;
+  hw->image.flash_writes++;
+}
+
+uint8_t slow_read(struct miuchiz_hardware *hw, uint16_t address);
+void slow_write(struct miuchiz_hardware *hw, uint16_t address, uint8_t value);
+
+// The bus as the CPU sees it. read_handler() and write_handler() are the
+// same thing for cpu_state.read and write, and cpu.c builds a copy of its
+// core around these so the page table lookups inline into it.
+static inline uint8_t miuchiz_read(struct miuchiz_hardware *hw, uint16_t address) {
+  uint8_t *page = hw->read_map[address >> 8];
+  if(page && address >= 0x80)
+    return hw->read_value = page[address & 0xff];
+  return slow_read(hw, address);
+}
+
+static inline void miuchiz_write(struct miuchiz_hardware *hw, uint16_t address, uint8_t value) {
+  uint8_t *page = hw->write_map[address >> 8];
+  if(page && address >= 0x80) {
+    page[address & 0xff] = value;
+    return;
+  }
+  slow_write(hw, address, value);
+}
+
+uint8_t read_handler(void *h, uint16_t address);
+void write_handler(void *h, uint16_t address, uint8_t value);
+void update_memory_map(struct miuchiz_hardware *hw);
+void flush_code_blocks(struct miuchiz_hardware *hw);
+void flush_code_range(struct miuchiz_hardware *hw, const uint8_t *start, size_t length);
+uint8_t flash_read(struct miuchiz_hardware *hw, uint32_t offset);
+void flash_write(struct miuchiz_hardware *hw, uint32_t offset, uint8_t value);
+// physical_address() puts the kind of memory in the top byte
+#define PHYSICAL_OFFSET(p) ((p) & 0xffffff)
+uint32_t physical_address(struct miuchiz_hardware *hw, uint16_t address);
+const char *physical_region_name(uint32_t physical);
+void run_instruction(struct cpu_state *s);
+int run_cycles(struct cpu_state *s, int cycles);
+void cpu_interrupt(struct cpu_state *s, uint16_t vector);
+
+uint64_t current_time(struct miuchiz_hardware *hw);
+void end_slice(struct miuchiz_hardware *hw);
+void schedule_event(struct miuchiz_hardware *hw, int type, uint64_t time);
+void cancel_event(struct miuchiz_hardware *hw, int type);
+int event_scheduled(struct miuchiz_hardware *hw, int type);
+void reset_scheduler(struct miuchiz_hardware *hw);
+void update_timers(struct miuchiz_hardware *hw, int restart);
+int miuchiz_run(struct cpu_state *cpu, struct miuchiz_hardware *hw, int cycles);
+
+void sound_set_rate(struct miuchiz_hardware *hw, uint32_t rate);
+void sound_update(struct miuchiz_hardware *hw);
+int sound_take(struct miuchiz_hardware *hw, int16_t *dest, int max);
+
+// what miuchiz_load_images() returns when an image is missing or too short,
+// it doesn't print anything itself so it can be used from libmiuchiz
+#define MIUCHIZ_BAD_OTP   -1
+#define MIUCHIZ_BAD_FLASH -2
+
+void miuchiz_reset(struct cpu_state *cpu, struct miuchiz_hardware *hw);
+int miuchiz_load_images(struct miuchiz_hardware *hw, const char *otp_path, const char *flash_path);
+int miuchiz_load_images_from_memory(struct miuchiz_hardware *hw, const void *otp, size_t otp_size, const void *flash, size_t flash_size);
+void miuchiz_unload_images(struct miuchiz_hardware *hw);
+uint64_t miuchiz_pixel_hash(struct miuchiz_hardware *hw);
+uint64_t miuchiz_flash_base_hash(struct miuchiz_hardware *hw);
+void miuchiz_pixels_to_argb(struct miuchiz_hardware *hw, uint32_t *dest, int pitch);
+#endif
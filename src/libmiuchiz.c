@@ -0,0 +1,77 @@
+#include "libmiuchiz.h"
+#include "hardware.h"
+#include <stdlib.h>
+
+struct miuchiz {
+  struct cpu_state cpu;
+  struct miuchiz_hardware hw;
+};
+
+miuchiz *miuchiz_create(void) {
+  // calloc matters, miuchiz_reset() expects the images to start out empty
+  miuchiz *m = calloc(1, sizeof(miuchiz));
+  if(m)
+    miuchiz_reset(&m->cpu, &m->hw);
+  return m;
+}
+
+void miuchiz_destroy(miuchiz *m) {
+  if(!m)
+    return;
+  miuchiz_unload_images(&m->hw);
+  free(m);
+}
+
+void miuchiz_power_on(miuchiz *m) {
+  miuchiz_reset(&m->cpu, &m->hw);
+}
+
+int miuchiz_load_buffers(miuchiz *m, const void *otp, size_t otp_size, const void *flash, size_t flash_size) {
+  int error = miuchiz_load_images_from_memory(&m->hw, otp, otp_size, flash, flash_size);
+  miuchiz_power_on(m);
+  return error;
+}
+
+int miuchiz_load_files(miuchiz *m, const char *otp_path, const char *flash_path) {
+  int error = miuchiz_load_images(&m->hw, otp_path, flash_path);
+  miuchiz_power_on(m);
+  return error;
+}
+
+void miuchiz_run_cycles(miuchiz *m, int cycles) {
+  miuchiz_run(&m->cpu, &m->hw, cycles);
+}
+
+void miuchiz_run_frame(miuchiz *m) {
+  miuchiz_run_cycles(m, MIUCHIZ_CYCLES_PER_FRAME);
+}
+
+uint64_t miuchiz_cycles_run(miuchiz *m) {
+  return current_time(&m->hw);
+}
+
+const uint16_t *miuchiz_get_framebuffer(miuchiz *m, int *width, int *height) {
+  if(width)
+    *width = MIUCHIZ_WIDTH;
+  if(height)
+    *height = MIUCHIZ_HEIGHT;
+  return &m->hw.pixels[0][0];
+}
+
+void miuchiz_get_framebuffer_argb(miuchiz *m, uint32_t *dest, int pitch) {
+  miuchiz_pixels_to_argb(&m->hw, dest, pitch);
+}
+
+uint64_t miuchiz_framebuffer_hash(miuchiz *m) {
+  return miuchiz_pixel_hash(&m->hw);
+}
+
+void miuchiz_get_registers(miuchiz *m, struct miuchiz_registers *registers) {
+  registers->a = m->cpu.a;
+  registers->x = m->cpu.x;
+  registers->y = m->cpu.y;
+  registers->s = m->cpu.s;
+  registers->flags = cpu_get_flags(&m->cpu);
+  registers->pc = m->cpu.pc;
+  registers->waiting = m->cpu.waiting;
+}
@@ -0,0 +1,50 @@
+#ifndef LIBMIUCHIZ_HEADER
+#define LIBMIUCHIZ_HEADER
+// Embeddable emulator core with no SDL dependency and no global state.
+// Every function takes the context it works on, so any number of them can
+// exist at once, as long as each one is only used by one thread at a time.
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the only symbols libmiuchiz.so exports, the rest of the core is hidden
+#if defined(__GNUC__) && !defined(_WIN32)
+#define MIUCHIZ_API __attribute__((visibility("default")))
+#else
+#define MIUCHIZ_API
+#endif
+
+typedef struct miuchiz miuchiz;
+
+struct miuchiz_registers {
+  uint8_t a, x, y, s, flags;
+  uint16_t pc;
+  int waiting;
+};
+
+MIUCHIZ_API miuchiz *miuchiz_create(void);
+MIUCHIZ_API void miuchiz_destroy(miuchiz *m);
+
+// Buffers shorter than the real chips are zero-filled, files have to be
+// full size. Both calls reset the emulator and return nonzero on failure.
+MIUCHIZ_API int miuchiz_load_buffers(miuchiz *m, const void *otp, size_t otp_size, const void *flash, size_t flash_size);
+MIUCHIZ_API int miuchiz_load_files(miuchiz *m, const char *otp_path, const char *flash_path);
+MIUCHIZ_API void miuchiz_power_on(miuchiz *m);
+
+MIUCHIZ_API void miuchiz_run_cycles(miuchiz *m, int cycles);
+MIUCHIZ_API void miuchiz_run_frame(miuchiz *m);
+MIUCHIZ_API uint64_t miuchiz_cycles_run(miuchiz *m);
+
+// Row-major 0x0RGB pixels, valid for as long as the context is
+MIUCHIZ_API const uint16_t *miuchiz_get_framebuffer(miuchiz *m, int *width, int *height);
+MIUCHIZ_API void miuchiz_get_framebuffer_argb(miuchiz *m, uint32_t *dest, int pitch);
+MIUCHIZ_API uint64_t miuchiz_framebuffer_hash(miuchiz *m);
+MIUCHIZ_API void miuchiz_get_registers(miuchiz *m, struct miuchiz_registers *registers);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,264 @@
+// Microbenchmarks: small loops that each lean on one part of the CPU core
+// or the bus, so a change in speed can be pinned on the path that caused it
+#include "hardware.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define UNROLL 16          // copies of the body in each trip around the loop
+#define FLASH_CODE 0x8000  // where code in flash runs, through DRR
+#define RAM_CODE   0x0400  // where code in RAM runs
+
+enum {
+  IN_FLASH,
+  IN_RAM
+};
+
+// Each benchmark runs its setup once, then loops over UNROLL copies of its
+// body and a JMP back. The loop has no backward branches, so idle loop
+// skipping can't cut it short. Bodies with a JSR get the address of an RTS
+// after the loop patched in.
+struct microbench {
+  const char *name;
+  int where;
+  uint8_t setup[16];
+  int setup_length;
+  uint8_t body[16];
+  int body_length;
+};
+
+#define CODE(...) {__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__})
+#define NONE {0}, 0
+// zero page $20 points at $0300, and Y is 0
+#define POINTER_SETUP CODE(0xa9,0x00, 0x85,0x20, 0xa9,0x03, 0x85,0x21, 0xa0,0x00)
+
+static const struct microbench benchmarks[] = {
+  // lda #, adc #, and #, ora #, eor #, cmp #
+  {"alu",         IN_FLASH, CODE(0x18), CODE(0xa9,0x12, 0x69,0x34, 0x29,0xf0, 0x09,0x0f, 0x49,0x55, 0xc9,0x80)},
+  // inc, dec, asl, lsr, rol, ror on zero page RAM, above the I/O registers
+  {"rmw",         IN_FLASH, NONE, CODE(0xe6,0x90, 0xc6,0x90, 0x06,0x90, 0x46,0x90, 0x26,0x90, 0x66,0x90)},
+  // bne taken, beq not taken, with Z clear
+  {"branch",      IN_FLASH, CODE(0xa2,0x01), CODE(0xd0,0x00, 0xf0,0x00)},
+  // jsr to an rts
+  {"jsr_rts",     IN_FLASH, NONE, CODE(0x20,0x00,0x00)},
+  // adc # and sbc # in decimal mode
+  {"decimal",     IN_FLASH, CODE(0xf8, 0x18, 0xa9,0x00), CODE(0x69,0x19, 0xe9,0x07)},
+  // lda zp, sta zp, also in RAM
+  {"zeropage",    IN_FLASH, NONE, CODE(0xa5,0x90, 0x85,0x91)},
+  // lda abs, sta abs
+  {"absolute",    IN_FLASH, NONE, CODE(0xad,0x10,0x03, 0x8d,0x11,0x03)},
+  // lda (zp),y, sta (zp),y
+  {"indirect_y",  IN_FLASH, POINTER_SETUP, CODE(0xb1,0x20, 0x91,0x20)},
+  // the same register only instructions fetched from banked flash and from RAM
+  {"fetch_flash", IN_FLASH, NONE, CODE(0xe8, 0xc8, 0xca, 0x88)},
+  {"fetch_ram",   IN_RAM,   NONE, CODE(0xe8, 0xc8, 0xca, 0x88)},
+};
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Single instructions with known cycle counts, for --check-cycles. Each one
+// runs from RAM at the given address with X set to 1.
+struct cycle_check {
+  const char *name;
+  uint16_t address;
+  uint8_t code[4];
+  int length;
+  int cycles;
+};
+
+static const struct cycle_check cycle_checks[] = {
+  {"bra",                    0x0400, CODE(0x80,0x10),      3},
+  {"bra, page cross",        0x04f0, CODE(0x80,0x20),      4},
+  {"asl abs,x",              0x0400, CODE(0x1e,0x00,0x03), 6},
+  {"asl abs,x, page cross",  0x0400, CODE(0x1e,0xff,0x02), 7},
+  {"ror abs,x, page cross",  0x0400, CODE(0x7e,0xff,0x02), 7},
+  {"inc abs,x",              0x0400, CODE(0xfe,0x00,0x03), 7},
+  {"inc abs,x, page cross",  0x0400, CODE(0xfe,0xff,0x02), 7},
+};
+#define CYCLE_CHECK_COUNT (int)(sizeof(cycle_checks) / sizeof(cycle_checks[0]))
+
+struct cpu_state cpu;
+struct miuchiz_hardware hw;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-c cycles] [-r repeats] [--tsv file] [--no-block-cache] [--check-cycles] [benchmark...]\n", name);
+  printf("  -c                CPU cycles to run each benchmark for (default 8000000)\n");
+  printf("  -r                timed runs of each benchmark (default 7)\n");
+  printf("  --tsv file        also write the results as tab separated values\n");
+  printf("  --no-block-cache  interpret all code instead of predecoding flash\n");
+  printf("  --check-cycles    check the cycle counts of some instructions instead\n");
+  printf("benchmarks:");
+  for(int i=0; i<BENCHMARK_COUNT; i++)
+    printf(" %s", benchmarks[i].name);
+  printf("\n");
+}
+
+// Assembles a benchmark where it runs and points the CPU at it
+static void load_benchmark(const struct microbench *b, int block_cache) {
+  miuchiz_reset(&cpu, &hw);
+  memset(hw.image.flash, 0, 0x8000);
+  hw.DRR = 0x0100; // flash from 0 at $8000
+  update_memory_map(&hw);
+  flush_code_blocks(&hw);
+  cpu.skip_idle = 0;
+  if(!block_cache)
+    cpu.code_map = NULL;
+
+  uint16_t origin = b->where == IN_FLASH ? FLASH_CODE : RAM_CODE;
+  uint8_t *code = b->where == IN_FLASH ? hw.image.flash : &hw.ram[RAM_CODE];
+  uint16_t loop = origin + b->setup_length;
+  uint16_t subroutine = loop + UNROLL * b->body_length + 3;
+  uint8_t *out = code;
+  memcpy(out, b->setup, b->setup_length);
+  out += b->setup_length;
+  for(int i=0; i<UNROLL; i++) {
+    memcpy(out, b->body, b->body_length);
+    if(out[0] == 0x20) {
+      out[1] = subroutine & 0xff;
+      out[2] = subroutine >> 8;
+    }
+    out += b->body_length;
+  }
+  *out++ = 0x4c; // jmp loop
+  *out++ = loop & 0xff;
+  *out++ = loop >> 8;
+  *out++ = 0x60; // rts
+  cpu.pc = origin;
+}
+
+struct result {
+  double mean, stddev, min, max; // ns per instruction
+  double instructions;           // per run
+  double cycles_per_instruction;
+};
+
+static void run_benchmark(const struct microbench *b, int block_cache, int cycles, int repeats, struct result *r) {
+  double samples[repeats];
+  long long instructions = 0;
+  load_benchmark(b, block_cache);
+  // once untimed, to fill the block cache and the host's caches
+  miuchiz_run(&cpu, &hw, cycles / 4);
+  for(int i=0; i<repeats; i++) {
+    uint64_t start = now_ns();
+    int ran = miuchiz_run(&cpu, &hw, cycles);
+    uint64_t elapsed = now_ns() - start;
+    samples[i] = ran ? (double)elapsed / ran : 0;
+    instructions += ran;
+  }
+
+  r->mean = r->stddev = 0;
+  r->min = r->max = samples[0];
+  for(int i=0; i<repeats; i++) {
+    r->mean += samples[i] / repeats;
+    if(samples[i] < r->min)
+      r->min = samples[i];
+    if(samples[i] > r->max)
+      r->max = samples[i];
+  }
+  for(int i=0; i<repeats && repeats > 1; i++)
+    r->stddev += (samples[i] - r->mean) * (samples[i] - r->mean) / (repeats - 1);
+  r->stddev = sqrt(r->stddev);
+  r->instructions = (double)instructions / repeats;
+  r->cycles_per_instruction = instructions ? (double)cycles * repeats / instructions : 0;
+}
+
+// Runs each of cycle_checks once and compares the cycles it took
+static int check_cycles(void) {
+  int failures = 0;
+  for(int i=0; i<CYCLE_CHECK_COUNT; i++) {
+    const struct cycle_check *c = &cycle_checks[i];
+    miuchiz_reset(&cpu, &hw);
+    memcpy(&hw.ram[c->address], c->code, c->length);
+    cpu.pc = c->address;
+    cpu.x = 1;
+    int start = cpu.cycles;
+    run_instruction(&cpu);
+    int took = cpu.cycles - start;
+    if(took != c->cycles) {
+      printf("%s: took %d cycles, expected %d\n", c->name, took, c->cycles);
+      failures++;
+    }
+  }
+  printf("checked %d instructions, %d failures\n", CYCLE_CHECK_COUNT, failures);
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int cycles = 8000000, repeats = 7, block_cache = 1, cycle_check = 0;
+  const char *tsv_path = NULL;
+  int selected[BENCHMARK_COUNT], any_selected = 0;
+  memset(selected, 0, sizeof(selected));
+
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "-c") && i+1 < argc) {
+      cycles = strtol(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "-r") && i+1 < argc) {
+      repeats = strtol(argv[++i], NULL, 0);
+    } else if(!strcmp(argv[i], "--tsv") && i+1 < argc) {
+      tsv_path = argv[++i];
+    } else if(!strcmp(argv[i], "--no-block-cache")) {
+      block_cache = 0;
+    } else if(!strcmp(argv[i], "--check-cycles")) {
+      cycle_check = 1;
+    } else {
+      int found = 0;
+      for(int j=0; j<BENCHMARK_COUNT; j++)
+        if(!strcmp(argv[i], benchmarks[j].name))
+          selected[j] = found = any_selected = 1;
+      if(!found) {
+        usage(argv[0]);
+        return -1;
+      }
+    }
+  }
+  if(cycles <= 0 || repeats <= 0) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  // blank images, the benchmarks bring their own code
+  static uint8_t blank[MIUCHIZ_OTP_SIZE];
+  miuchiz_reset(&cpu, &hw);
+  if(miuchiz_load_images_from_memory(&hw, blank, sizeof(blank), blank, sizeof(blank))) {
+    puts("Not enough memory for the images");
+    return -1;
+  }
+  if(cycle_check) {
+    int failures = check_cycles();
+    miuchiz_unload_images(&hw);
+    return failures ? -1 : 0;
+  }
+
+  FILE *tsv = NULL;
+  if(tsv_path) {
+    tsv = fopen(tsv_path, "w");
+    if(!tsv) {
+      printf("Can't open %s for writing\n", tsv_path);
+      return -1;
+    }
+    fprintf(tsv, "benchmark\tns_per_instruction\tstddev\tmin\tmax\tcycles_per_instruction\tinstructions_per_run\n");
+  }
+
+  printf("%-12s %10s %8s %8s %8s %8s\n", "benchmark", "ns/instr", "stddev", "min", "max", "cycles");
+  for(int i=0; i<BENCHMARK_COUNT; i++) {
+    if(any_selected && !selected[i])
+      continue;
+    struct result r;
+    run_benchmark(&benchmarks[i], block_cache, cycles, repeats, &r);
+    printf("%-12s %10.3f %8.3f %8.3f %8.3f %8.2f\n", benchmarks[i].name, r.mean, r.stddev, r.min, r.max, r.cycles_per_instruction);
+    if(tsv)
+      fprintf(tsv, "%s\t%.4f\t%.4f\t%.4f\t%.4f\t%.3f\t%.0f\n", benchmarks[i].name, r.mean, r.stddev, r.min, r.max,
+        r.cycles_per_instruction, r.instructions);
+  }
+  if(tsv)
+    fclose(tsv);
+  miuchiz_unload_images(&hw);
+  return 0;
+}
@@ -1,206 +1,326 @@
 #include "miuchiz.h"
+#include "profiler.h"
+#include "trace.h"
+#include "debugger.h"
+#include "audio.h"
+#include "flash.h"
 #include <math.h>
+#include <signal.h>
 int ScreenWidth, ScreenHeight, ScreenZoom = 4;
 
 SDL_Window *window = NULL;
 SDL_Renderer *ScreenRenderer = NULL;
+SDL_Texture *ScreenTexture = NULL;
 int quit = 0;
 int retraces = 0;
 
-struct miuchiz_hardware {
-  uint8_t ram[0x8000]; // 32KB
-  uint16_t BRR; // bios bank
-  uint16_t PRR; // program bank
-  uint16_t DRR; // data bank
-  int cursor_x;
-  int cursor_y;
-  int cursor_odd;
-  uint8_t flash[1024 * 1024 * 2];
-  uint8_t otp[0x4000];
-
-  uint8_t read_value; // last read value, for open bus
-  uint8_t pixel_buffer;
-  uint16_t pixels[MIUCHIZ_WIDTH][MIUCHIZ_HEIGHT];
+// Finished frames go from the emulation thread to the main thread through
+// three buffers: the one being drawn, the one on screen, and the newest
+// finished one between them. Handing one over is a single atomic swap, so
+// neither thread ever waits on the other.
+#define FRAME_FRESH 4 // in frames.middle when it hasn't been shown yet
+
+struct frame_buffers {
+  uint32_t pixels[3][MIUCHIZ_HEIGHT * MIUCHIZ_WIDTH]; // ARGB
+  int back;  // only the emulation thread uses it
+  int front; // only the main thread uses it
+  SDL_atomic_t middle;
 };
 
-uint8_t video_read(struct miuchiz_hardware *hw, uint16_t address) {
-  if(address & 1) { // data
-    return 0xff;
-  } else {          // control
-    return 0xca;
-  }
+struct frame_buffers frames = {.back = 0, .front = 1, .middle = {2}};
+
+void publish_frame(struct frame_buffers *f) {
+  f->back = SDL_AtomicSet(&f->middle, f->back | FRAME_FRESH) & 3;
 }
 
-void video_write(struct miuchiz_hardware *hw, uint16_t address, uint8_t value) {
-  if(address & 1) { // data
-    // write a pixel
-    if((hw->cursor_odd & 1) == 0) {
-      hw->pixel_buffer = value;
-    } else {
-      hw->pixels[hw->cursor_x][hw->cursor_y] = (hw->pixel_buffer << 8) | value;
-      hw->cursor_x++;
-      if(hw->cursor_x >= MIUCHIZ_WIDTH) {
-        hw->cursor_x = 0;
-        hw->cursor_y++;
-      }
-      if(hw->cursor_y >= MIUCHIZ_HEIGHT) {
-        hw->cursor_y = 0;
-      }
-    }
+// Returns 1 if there's a newer frame in front
+int take_frame(struct frame_buffers *f) {
+  if(!(SDL_AtomicGet(&f->middle) & FRAME_FRESH))
+    return 0;
+  f->front = SDL_AtomicSet(&f->middle, f->front) & 3;
+  return 1;
+}
 
-    hw->cursor_odd ^= 1;
-  } else {          // control
-    // do nothing
-  }
+// Copies a frame into a native resolution streaming texture and scales it up in one copy
+void update_screen(const uint32_t *pixels) {
+  SDL_UpdateTexture(ScreenTexture, NULL, pixels, MIUCHIZ_WIDTH * sizeof(*pixels));
+  SDL_RenderCopy(ScreenRenderer, ScreenTexture, NULL, NULL);
 }
 
-uint8_t read_handler(void *h, uint16_t address) {
-//  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "reading address %.4x", address);
-  struct miuchiz_hardware *hw = h;
-
-  // fixed bank of RAM
-  if(address >= 0x0080 && address <= 0x1fff) {
-    hw->read_value = hw->ram[address];
-    return hw->read_value;
-  }
-
-  int bank = 0, is_ram = 0, offset = 0;
-  if(address >= 0x2000 && address <= 0x3fff) {
-    bank = hw->BRR;
-    is_ram = hw->BRR & 0x8000;
-    offset = address & 0x1fff;
-  }
-  else if(address >= 0x4000 && address <= 0x7fff) {
-    bank = (hw->PRR << 1) & 0x7fff;
-    is_ram = hw->PRR & 0x8000;
-    offset = address & 0x3fff;
-  }
-  else if(address >= 0x8000 && address <= 0xffff) {
-    bank = (hw->DRR << 2) & 0x7fff;
-    is_ram = hw->DRR & 0x8000;
-    offset = address & 0x7fff;
-  }
-
-  // Handle the external read
-  if(is_ram) {
-    hw->read_value = hw->ram[address & 0x7fff];
-  } else {
-    if(((bank & 0x9e00) == 0x0000) || ((bank & 0x9e00) == 0x1e00)) {
-    // OTP
-      hw->read_value = hw->otp[((bank&1)*8192+offset) & 0x3fff];
-
-    } else if((bank & 0x9f00) == 0x0300) {
-    // video
-      hw->read_value = video_read(hw, address);
-
-    } else if((bank & 0x9c00) == 0x0400) {
-    // flash
-      int flash_address = ((bank&0xff)*8192+offset) & 0x1fffff;
-      hw->read_value = hw->flash[flash_address];
-    }
-  }
+struct cpu_state cpu;
+struct miuchiz_hardware hw;
+struct savestate_tracker savestates;
+struct rewind_buffer rewinder;
+const char *state_path = "miuchiz.sav";
+#ifdef MIUCHIZ_PROFILER
+struct profiler profiler;
+const char *profile_prefix = NULL;
+#endif
+struct trace_buffer trace;
+struct debugger debugger;
+struct audio_output audio;
+struct flash_journal journal;
+const char *trace_path = "miuchiz.trace";
+
+// Best effort, so a crash in the core still leaves the last instructions behind
+void crash_handler(int sig) {
+  signal(sig, SIG_DFL);
+  trace_dump(&trace, trace_path);
+  raise(sig);
+}
+
+// Frame pacing, on the emulation thread. Frames are due at fixed points on
+// the performance counter rather than a fixed sleep after each one, so time
+// spent emulating doesn't add up into drift.
+struct pacer {
+  Uint64 frequency;  // performance counter ticks per second
+  Uint64 period;     // ticks per emulated frame at the current speed
+  Uint64 next;       // when the next frame is due
+  Uint64 last_draw;  // for drawing no faster than the display when fast forwarding
+};
+
+struct pacer pacer;
+double speed = 1.0;  // multiple of real time
+int turbo = 0;       // run as fast as possible
 
+void pacer_reset(struct pacer *p) {
+  p->frequency = SDL_GetPerformanceFrequency();
+  p->period = p->frequency / (MIUCHIZ_FRAME_RATE * speed);
+  p->next = SDL_GetPerformanceCounter() + p->period;
+}
 
-  return hw->read_value;
+// Sleeps until the next frame is due, a millisecond at a time so an
+// oversleeping SDL_Delay() can't miss it by much. Only the last 200us are
+// waited out on the counter, which keeps an idle core idle.
+void pacer_wait(struct pacer *p) {
+  Uint64 now = SDL_GetPerformanceCounter(), spin = p->frequency / 5000;
+  for(Uint64 t = now; t + spin < p->next; t = SDL_GetPerformanceCounter())
+    SDL_Delay(1);
+  while(SDL_GetPerformanceCounter() < p->next);
+  p->next += p->period;
+  // after a long stall, like dragging the window, don't race to catch up
+  if(now > p->next + p->period * MIUCHIZ_FRAME_RATE / 4)
+    p->next = now + p->period;
 }
 
-void write_handler(void *h, uint16_t address, uint8_t value) {
-///  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "writing %.2x to %.4x", value, address);
-  struct miuchiz_hardware *hw = h;
+// Whether this frame gets handed to the main thread. Presenting happens
+// there, so only fast forwarding has frames worth dropping.
+int pacer_draw(struct pacer *p, int fast) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  if(fast && now - p->last_draw < p->frequency / MIUCHIZ_FRAME_RATE)
+    return 0;
+  p->last_draw = now;
+  return 1;
+}
 
-  // fixed bank of RAM
-  if(address >= 0x0080 && address <= 0x1fff) {
-    hw->ram[address] = value;
-    return;
-  }
+// What the main thread asks the emulation thread to do, since only the
+// emulation thread touches the emulator
+#define REQUEST_SAVE     1
+#define REQUEST_LOAD     2
+#define REQUEST_TRACE    4
+#define REQUEST_CONTINUE 8
+
+SDL_atomic_t requests;
+SDL_atomic_t running;
+SDL_atomic_t rewinding;  // backspace is held
+SDL_atomic_t turbo_held; // tab is held
+
+void post_request(int request) {
+  int old;
+  do {
+    old = SDL_AtomicGet(&requests);
+  } while(!SDL_AtomicCAS(&requests, old, old | request));
+}
 
-  int bank = 0, is_ram = 0;
-  if(address >= 0x2000 && address <= 0x3fff) {
-    bank = hw->BRR;
-    is_ram = hw->BRR & 0x8000;
-  }
-  else if(address >= 0x4000 && address <= 0x7fff) {
-    bank = (hw->PRR << 1) & 0x7fff;
-    is_ram = hw->PRR & 0x8000;
+// Flash journal records are written and synced, and the journal folded into
+// the image, on a thread of their own, so waiting on the disk never holds
+// up a frame. The emulation thread
+// collects them and posts journal_ready, and only collects again once the
+// writer has cleared journal_busy.
+SDL_sem *journal_ready;
+SDL_atomic_t journal_busy;
+
+int journal_thread(void *data) {
+  while(SDL_SemWait(journal_ready) == 0) {
+    if(SDL_AtomicGet(&journal_busy)) {
+      flash_journal_write(&journal);
+      SDL_AtomicSet(&journal_busy, 0);
+    } else if(!SDL_AtomicGet(&running)) {
+      break;
+    }
   }
-  else if(address >= 0x8000 && address <= 0xffff) {
-    bank = (hw->DRR << 2) & 0x7fff;
-    is_ram = hw->DRR & 0x8000;
+  return 0;
+}
+
+void save_state_file(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if(!file) {
+    printf("Can't open %s for writing\n", path);
+    return;
   }
+  // quick saves overwrite each other, so always write a keyframe
+  savestate_save(&savestates, &cpu, &hw, file, 0);
+  fclose(file);
+}
 
-  // Handle the external write
-  if(is_ram) {
-    hw->ram[address & 0x7fff] = value;
-  } else {
-    if(((bank & 0x9e00) == 0x0000) || ((bank & 0x9e00) == 0x1e00)) {
-    // OTP
+void load_state_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if(!file) {
+    printf("Can't open %s\n", path);
+    return;
+  }
+  savestate_load(&savestates, &cpu, &hw, file);
+  fclose(file);
+}
 
-    } else if((bank & 0x9f00) == 0x0300) {
-    // video
-      video_write(hw, address, value);
-    } else if((bank & 0x9c00) == 0x0400) {
-    // flash
+int emulation_thread(void *data) {
+  int was_fast = 0;
+  pacer_reset(&pacer);
+  while(SDL_AtomicGet(&running)) {
+    int request = SDL_AtomicSet(&requests, 0);
+    if(request & REQUEST_SAVE)
+      save_state_file(state_path);
+    if(request & REQUEST_LOAD)
+      load_state_file(state_path);
+    if((request & REQUEST_TRACE) && cpu.trace)
+      trace_dump(&trace, trace_path);
+    if(request & REQUEST_CONTINUE)
+      debugger_continue(&debugger);
+
+    int fast = turbo || SDL_AtomicGet(&turbo_held);
+    if(was_fast && !fast)
+      pacer_reset(&pacer);
+    was_fast = fast;
+
+    // holding backspace steps back one recorded state per frame
+    if(SDL_AtomicGet(&rewinding)) {
+      rewind_step(&rewinder, &cpu, &hw);
+    } else if(!debugger.hit) {
+      miuchiz_run(&cpu, &hw, MIUCHIZ_CYCLES_PER_FRAME);
+      audio_frame(&audio, &hw);
+      rewind_frame(&rewinder, &cpu, &hw);
+      if(debugger.hit) {
+        char text[128];
+        debugger_describe_hit(&debugger, text, sizeof(text));
+        printf("Stopped: %s, A:%.2x X:%.2x Y:%.2x S:%.2x P:%.2x, F10 continues\n", text, cpu.a, cpu.x, cpu.y, cpu.s, cpu_get_flags(&cpu));
+      }
+    }
 
+    if(pacer_draw(&pacer, fast)) {
+      miuchiz_pixels_to_argb(&hw, frames.pixels[frames.back], MIUCHIZ_WIDTH * sizeof(uint32_t));
+      publish_frame(&frames);
+    }
+    if(!fast)
+      pacer_wait(&pacer);
+    // once a second is plenty for anything the firmware writes to flash
+    if(journal_ready && retraces % MIUCHIZ_FRAME_RATE == 0 && !SDL_AtomicGet(&journal_busy) &&
+       flash_journal_collect(&journal, &hw)) {
+      SDL_AtomicSet(&journal_busy, 1);
+      SDL_SemPost(journal_ready);
     }
+    retraces++;
   }
-
+  return 0;
 }
 
-void update_screen(struct miuchiz_hardware *hw) {
-  for(int x = 0; x < MIUCHIZ_WIDTH; x++) {
-    for(int y = 0; y < MIUCHIZ_HEIGHT; y++) {
-       uint16_t pixel = hw->pixels[x][y];
-       int r = (pixel >> 8) & 0xf;
-       int g = (pixel >> 4) & 0xf;
-       int b = (pixel >> 0) & 0xf;
-       // extend 5 into 55 and so on
-       SDL_SetRenderDrawColor(ScreenRenderer, r|(r<<4), g|(g<<4), b|(b<<4), 255);
-       SDL_Rect rect = {x*ScreenZoom, y*ScreenZoom, ScreenZoom, ScreenZoom};
-       SDL_RenderFillRect(ScreenRenderer, &rect);
+int main(int argc, char *argv[]) {
+  const char *otp_path = "data/otp.dat", *flash_path = "data/flash.dat";
+  int rewind_frames = 2, rewind_mb = 16;
+  long trace_length = 0;
+  int sound = 1, vsync = 0, save_flash = 1;
+  const char *breakpoints[DEBUG_BREAKPOINTS];
+  int breakpoint_count = 0;
+  const char *watch_kinds[DEBUG_WATCHPOINTS], *watch_ranges[DEBUG_WATCHPOINTS];
+  int watch_count = 0;
+  for(int i=1; i<argc; i++) {
+    if(!strcmp(argv[i], "--otp") && i+1 < argc)
+      otp_path = argv[++i];
+    else if(!strcmp(argv[i], "--flash") && i+1 < argc)
+      flash_path = argv[++i];
+    else if(!strcmp(argv[i], "--state") && i+1 < argc)
+      state_path = argv[++i];
+    else if(!strcmp(argv[i], "--rewind-frames") && i+1 < argc)
+      rewind_frames = strtol(argv[++i], NULL, 0);
+    else if(!strcmp(argv[i], "--rewind-mb") && i+1 < argc)
+      rewind_mb = strtol(argv[++i], NULL, 0);
+    else if(!strcmp(argv[i], "--trace") && i+1 < argc)
+      trace_length = strtol(argv[++i], NULL, 0);
+    else if(!strcmp(argv[i], "--trace-file") && i+1 < argc)
+      trace_path = argv[++i];
+    else if(!strcmp(argv[i], "--speed") && i+1 < argc)
+      speed = strtod(argv[++i], NULL);
+    else if(!strcmp(argv[i], "--turbo"))
+      turbo = 1;
+    else if(!strcmp(argv[i], "--vsync"))
+      vsync = 1;
+    else if(!strcmp(argv[i], "--no-audio"))
+      sound = 0;
+    else if(!strcmp(argv[i], "--no-flash-save"))
+      save_flash = 0;
+    else if(!strcmp(argv[i], "--break") && i+1 < argc && breakpoint_count < DEBUG_BREAKPOINTS)
+      breakpoints[breakpoint_count++] = argv[++i];
+    else if(!strcmp(argv[i], "--watch") && i+2 < argc && watch_count < DEBUG_WATCHPOINTS) {
+      watch_kinds[watch_count] = argv[++i];
+      watch_ranges[watch_count++] = argv[++i];
     }
+#ifdef MIUCHIZ_PROFILER
+    else if(!strcmp(argv[i], "--profile") && i+1 < argc)
+      profile_prefix = argv[++i];
+#endif
   }
-}
 
-struct cpu_state cpu;
-struct miuchiz_hardware hw;
-void run_instruction(struct cpu_state *s);
+  if(speed <= 0)
+    speed = 1.0;
 
-int main(int argc, char *argv[]) {
   // Initialize the hardware
-  memset(&cpu, 0, sizeof(cpu));
-  memset(&hw, 0, sizeof(hw));
-  cpu.hardware = &hw;
-  cpu.read = read_handler;
-  cpu.write = write_handler;
-  hw.PRR = 0x7202;
-  hw.BRR = 0xe000;
-  hw.DRR = 0x78c0;
-  cpu.pc = 0x4000;
-  cpu.s = 0xff;
-
-  // read OTP
-  FILE *file = fopen("data/otp.dat", "rb");
-  if(file == NULL) {
-    puts("Can't open OTP");
+  miuchiz_reset(&cpu, &hw);
+  int error = miuchiz_load_images(&hw, otp_path, flash_path);
+  if(error == MIUCHIZ_BAD_OTP)
+    printf("Can't load OTP: %s, it has to be %d bytes\n", otp_path, MIUCHIZ_OTP_SIZE);
+  else if(error)
+    printf("Can't load flash: %s, it has to be %d bytes\n", flash_path, MIUCHIZ_FLASH_SIZE);
+  if(error)
     return -1;
+  if(save_flash && flash_journal_open(&journal, &hw, flash_path))
+    puts("Flash writes won't be saved");
+  savestate_init(&savestates);
+  if(rewind_mb > 0 && rewind_init(&rewinder, (size_t)rewind_mb << 20, rewind_frames))
+    puts("Not enough memory for rewind");
+#ifdef MIUCHIZ_PROFILER
+  if(profile_prefix && !profiler_init(&profiler, &hw))
+    cpu.profiler = &profiler;
+#endif
+  // F10 continues after one is hit
+  debugger_init(&debugger, &cpu, &hw);
+  for(int i=0; i<breakpoint_count; i++) {
+    uint32_t address;
+    if(debugger_parse_address(breakpoints[i], &address) || debugger_add_breakpoint(&debugger, address))
+      printf("Bad breakpoint %s\n", breakpoints[i]);
   }
-  fread(hw.otp, 1, sizeof(hw.otp), file);
-  fclose(file);
-
-  // read flash
-  file = fopen("data/flash.dat", "rb");
-  if(file == NULL) {
-    puts("Can't open flash");
-    return -1;
+  for(int i=0; i<watch_count; i++) {
+    uint32_t start, end;
+    int kind = (strchr(watch_kinds[i], 'r') ? WATCH_READ : 0) | (strchr(watch_kinds[i], 'w') ? WATCH_WRITE : 0);
+    if(!kind || debugger_parse_range(watch_ranges[i], &start, &end) || debugger_add_watchpoint(&debugger, start, end, kind))
+      printf("Bad watchpoint %s %s\n", watch_kinds[i], watch_ranges[i]);
+  }
+  // keeps the last instructions run, F9 writes them out
+  if(trace_length > 0) {
+    if(trace_init(&trace, trace_length)) {
+      puts("Not enough memory for the trace");
+    } else {
+      trace_start(&trace, &cpu, &hw);
+      signal(SIGSEGV, crash_handler);
+      signal(SIGABRT, crash_handler);
+    }
   }
-  fread(hw.flash, 1, sizeof(hw.flash), file);
-  fclose(file);
   // ------------------------------------------------------
 
   if(SDL_Init(SDL_INIT_VIDEO) < 0){
     printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
     return -1;
   }
+  if(sound)
+    audio_open(&audio, &hw);
   ScreenWidth = MIUCHIZ_WIDTH * ScreenZoom;
   ScreenHeight = MIUCHIZ_HEIGHT * ScreenZoom;
   window = SDL_CreateWindow("Miuchiz emulator?", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, ScreenWidth, ScreenHeight, SDL_WINDOW_SHOWN);
@@ -216,26 +336,94 @@ int main(int argc, char *argv[]) {
     SDL_MessageBox(SDL_MESSAGEBOX_ERROR, "Error", NULL, "SDL_ttf could not initialize! SDL_ttf Error: %s", TTF_GetError());
     return -1;
   }
-  ScreenRenderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  // emulation keeps its own pace on its thread, so vsync only affects presenting
+  ScreenRenderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
+  ScreenTexture = SDL_CreateTexture(ScreenRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, MIUCHIZ_WIDTH, MIUCHIZ_HEIGHT);
+  if(!ScreenTexture) {
+    SDL_MessageBox(SDL_MESSAGEBOX_ERROR, "Error", window, "Screen texture could not be created! SDL_Error: %s", SDL_GetError());
+    return -1;
+  }
   // ------------------------------------------------------
 
+  // The main thread only handles input and shows whatever frame is newest
+  SDL_AtomicSet(&running, 1);
+  SDL_Thread *journal_writer = NULL;
+  if(journal.open && (journal_ready = SDL_CreateSemaphore(0))) {
+    if(!(journal_writer = SDL_CreateThread(journal_thread, "flash journal", NULL))) {
+      SDL_DestroySemaphore(journal_ready);
+      journal_ready = NULL;
+    }
+  }
+  if(journal.open && !journal_writer)
+    puts("Flash writes will only be saved on exit");
+  SDL_Thread *emulation = SDL_CreateThread(emulation_thread, "emulation", NULL);
+  if(!emulation) {
+    SDL_MessageBox(SDL_MESSAGEBOX_ERROR, "Error", window, "Emulation thread could not be created! SDL_Error: %s", SDL_GetError());
+    return -1;
+  }
   SDL_Event e;
   while(!quit) {
-    while(SDL_PollEvent(&e) != 0) {
-      if(e.type == SDL_QUIT)
-        quit = 1;
+    // wakes up for input right away, and often enough to not sit on a new frame
+    if(SDL_WaitEventTimeout(&e, 2)) {
+      do {
+        if(e.type == SDL_QUIT)
+          quit = 1;
+        else if(e.type == SDL_KEYDOWN && !e.key.repeat) {
+          switch(e.key.keysym.sym) {
+            case SDLK_F5:
+              post_request(REQUEST_SAVE);
+              break;
+            case SDLK_F7:
+              post_request(REQUEST_LOAD);
+              break;
+            case SDLK_F9:
+              post_request(REQUEST_TRACE);
+              break;
+            case SDLK_F10:
+              post_request(REQUEST_CONTINUE);
+              break;
+            case SDLK_TAB:
+              SDL_AtomicSet(&turbo_held, 1);
+              break;
+            case SDLK_BACKSPACE:
+              SDL_AtomicSet(&rewinding, 1);
+              break;
+          }
+        } else if(e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_BACKSPACE) {
+          SDL_AtomicSet(&rewinding, 0);
+        } else if(e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_TAB) {
+          SDL_AtomicSet(&turbo_held, 0);
+        }
+      } while(SDL_PollEvent(&e));
     }
 
-    for(int i=0; i<1000; i++)
-      run_instruction(&cpu);
-
-    update_screen(&hw);
-    SDL_RenderPresent(ScreenRenderer);
-
-    SDL_Delay(17);
-    retraces++;
+    if(take_frame(&frames)) {
+      update_screen(frames.pixels[frames.front]);
+      SDL_RenderPresent(ScreenRenderer);
+    }
+  }
+  SDL_AtomicSet(&running, 0);
+  SDL_WaitThread(emulation, NULL);
+  // lets the writer finish what it has, and flash_journal_close() does the rest
+  if(journal_writer) {
+    SDL_SemPost(journal_ready);
+    SDL_WaitThread(journal_writer, NULL);
+    SDL_DestroySemaphore(journal_ready);
   }
+  audio_close(&audio);
+  SDL_DestroyTexture(ScreenTexture);
   SDL_Quit();
+  rewind_free(&rewinder);
+  trace_free(&trace);
+#ifdef MIUCHIZ_PROFILER
+  if(cpu.profiler) {
+    profiler_write(&profiler, profile_prefix);
+    profiler_free(&profiler);
+  }
+#endif
+  if(journal.open)
+    flash_journal_close(&journal, &hw);
+  miuchiz_unload_images(&hw);
 
   return 0;
 }
@@ -13,29 +13,14 @@
 #include <SDL2/SDL_ttf.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#endif
-
-#define MIUCHIZ_WIDTH 98
-#define MIUCHIZ_HEIGHT 67
-
-struct cpu_state {
-  uint8_t a;
-  uint8_t x;
-  uint8_t y;
-  uint8_t s;
-  uint8_t flags;
-  uint16_t pc;
-  int waiting;
-  int cycles;
-  void *hardware;
-  void (*write)(void*, uint16_t, uint8_t);
-  uint8_t (*read)(void*, uint16_t);
-};
-
+#include "hardware.h"
+#include "savestate.h"
+#include "rewind.h"
 
 extern int ScreenWidth, ScreenHeight, ScreenZoom;
 extern SDL_Window *window;
 extern SDL_Renderer *ScreenRenderer;
+extern SDL_Texture *ScreenTexture;
 extern int retraces;
 
 void SDL_MessageBox(int Type, const char *Title, SDL_Window *Window, const char *fmt, ...);
@@ -49,3 +34,4 @@ void blit(SDL_Texture* SrcBmp, SDL_Renderer* DstBmp, int SourceX, int SourceY, i
 void blitf(SDL_Texture* SrcBmp, SDL_Renderer* DstBmp, int SourceX, int SourceY, int DestX, int DestY, int Width, int Height, SDL_RendererFlip Flip);
 void blitz(SDL_Texture* SrcBmp, SDL_Renderer* DstBmp, int SourceX, int SourceY, int DestX, int DestY, int Width, int Height, int Width2, int Height2);
 void blitfull(SDL_Texture* SrcBmp, SDL_Renderer* DstBmp, int DestX, int DestY);
+#endif
@@ -0,0 +1,294 @@
+#include "profiler.h"
+#ifdef MIUCHIZ_PROFILER
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stands in for whatever called the reset vector
+#define ROOT_ROUTINE 0xffffffff
+
+static uint32_t mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// The tables are open addressed and kept under half full. An entry with
+// nothing counted in it yet is empty.
+
+static struct profile_counts *find_counts(struct profiler *p, uint32_t key);
+static struct profile_edge *find_edge(struct profiler *p, uint32_t caller, uint32_t callee);
+static struct profile_stack *find_stack(struct profiler *p, uint32_t hash, int depth, const uint32_t *frames);
+
+static int grow_counts(struct profiler *p) {
+  struct profile_counts *old = p->counts;
+  size_t old_size = p->counts_size, size = old_size ? old_size * 2 : 4096;
+  if(!(p->counts = calloc(size, sizeof(*p->counts)))) {
+    p->counts = old;
+    return -1;
+  }
+  p->counts_size = size;
+  p->counts_used = 0;
+  for(size_t i=0; i<old_size; i++)
+    if(old[i].instructions)
+      *find_counts(p, old[i].key) = old[i];
+  free(old);
+  return 0;
+}
+
+static struct profile_counts *find_counts(struct profiler *p, uint32_t key) {
+  if(p->counts_used * 2 >= p->counts_size && grow_counts(p))
+    return NULL;
+  size_t mask = p->counts_size - 1;
+  for(size_t i = mix(key) & mask; ; i = (i + 1) & mask) {
+    struct profile_counts *c = &p->counts[i];
+    if(!c->instructions) {
+      c->key = key;
+      p->counts_used++;
+      return c;
+    }
+    if(c->key == key)
+      return c;
+  }
+}
+
+static int grow_edges(struct profiler *p) {
+  struct profile_edge *old = p->edges;
+  size_t old_size = p->edges_size, size = old_size ? old_size * 2 : 1024;
+  if(!(p->edges = calloc(size, sizeof(*p->edges)))) {
+    p->edges = old;
+    return -1;
+  }
+  p->edges_size = size;
+  p->edges_used = 0;
+  for(size_t i=0; i<old_size; i++)
+    if(old[i].calls)
+      *find_edge(p, old[i].caller, old[i].callee) = old[i];
+  free(old);
+  return 0;
+}
+
+static struct profile_edge *find_edge(struct profiler *p, uint32_t caller, uint32_t callee) {
+  if(p->edges_used * 2 >= p->edges_size && grow_edges(p))
+    return NULL;
+  size_t mask = p->edges_size - 1;
+  for(size_t i = mix(caller ^ mix(callee)) & mask; ; i = (i + 1) & mask) {
+    struct profile_edge *e = &p->edges[i];
+    if(!e->calls) {
+      e->caller = caller;
+      e->callee = callee;
+      p->edges_used++;
+      return e;
+    }
+    if(e->caller == caller && e->callee == callee)
+      return e;
+  }
+}
+
+static int grow_stacks(struct profiler *p) {
+  struct profile_stack *old = p->stacks;
+  size_t old_size = p->stacks_size, size = old_size ? old_size * 2 : 1024;
+  if(!(p->stacks = calloc(size, sizeof(*p->stacks)))) {
+    p->stacks = old;
+    return -1;
+  }
+  p->stacks_size = size;
+  p->stacks_used = 0;
+  for(size_t i=0; i<old_size; i++)
+    if(old[i].cycles)
+      *find_stack(p, old[i].hash, old[i].depth, old[i].frames) = old[i];
+  free(old);
+  return 0;
+}
+
+static struct profile_stack *find_stack(struct profiler *p, uint32_t hash, int depth, const uint32_t *frames) {
+  if(p->stacks_used * 2 >= p->stacks_size && grow_stacks(p))
+    return NULL;
+  size_t mask = p->stacks_size - 1;
+  for(size_t i = hash & mask; ; i = (i + 1) & mask) {
+    struct profile_stack *t = &p->stacks[i];
+    if(!t->cycles) {
+      t->hash = hash;
+      t->depth = depth;
+      memcpy(t->frames, frames, depth * sizeof(*frames));
+      p->stacks_used++;
+      return t;
+    }
+    if(t->hash == hash && t->depth == depth && !memcmp(t->frames, frames, depth * sizeof(*frames)))
+      return t;
+  }
+}
+
+// Gives the cycles run since the stack last changed to the stack as it is now
+static void flush_self(struct profiler *p) {
+  if(!p->self)
+    return;
+  uint32_t frames[PROFILER_DEPTH];
+  for(int i=0; i<p->depth; i++)
+    frames[i] = p->frames[i].routine;
+  struct profile_stack *t = find_stack(p, p->depth ? p->frames[p->depth-1].hash : 0, p->depth, frames);
+  if(t)
+    t->cycles += p->self;
+  p->self = 0;
+}
+
+static void push_frame(struct profiler *p, uint32_t routine, uint8_t sp) {
+  flush_self(p);
+  if(p->depth >= PROFILER_DEPTH)
+    return;
+  uint32_t caller = p->depth ? p->frames[p->depth-1].routine : ROOT_ROUTINE;
+  struct profile_edge *e = find_edge(p, caller, routine);
+  if(e)
+    e->calls++;
+  struct profile_frame *f = &p->frames[p->depth];
+  f->routine = routine;
+  f->hash = mix((p->depth ? p->frames[p->depth-1].hash : 0) ^ routine);
+  f->sp = sp;
+  f->start = p->cycles;
+  p->depth++;
+}
+
+// Pops every frame that the stack pointer is now above, which also copes
+// with routines that drop their return address and return to their caller's
+static void pop_frames(struct profiler *p, uint8_t sp) {
+  flush_self(p);
+  while(p->depth && p->frames[p->depth-1].sp <= sp) {
+    struct profile_frame *f = &p->frames[--p->depth];
+    uint32_t caller = p->depth ? p->frames[p->depth-1].routine : ROOT_ROUTINE;
+    struct profile_edge *e = find_edge(p, caller, f->routine);
+    if(e)
+      e->cycles += p->cycles - f->start;
+  }
+}
+
+int profiler_init(struct profiler *p, struct miuchiz_hardware *hw) {
+  memset(p, 0, sizeof(*p));
+  p->hw = hw;
+  if(grow_counts(p) || grow_edges(p) || grow_stacks(p)) {
+    profiler_free(p);
+    return -1;
+  }
+  return 0;
+}
+
+void profiler_free(struct profiler *p) {
+  free(p->counts);
+  free(p->edges);
+  free(p->stacks);
+  p->counts = NULL;
+  p->edges = NULL;
+  p->stacks = NULL;
+}
+
+// Called after each instruction, with the PC and cycle count it started with
+void profile_instruction(struct profiler *p, struct cpu_state *s, uint16_t pc, uint8_t opcode, int cycles) {
+  struct profile_counts *c = find_counts(p, physical_address(p->hw, pc));
+  if(c) {
+    c->instructions++;
+    c->cycles += cycles;
+  }
+  p->cycles += cycles;
+  p->self += cycles;
+
+  if(opcode == 0x20)                       // JSR
+    push_frame(p, physical_address(p->hw, s->pc), s->s + 2);
+  else if(opcode == 0x60 || opcode == 0x40) // RTS, RTI
+    pop_frames(p, s->s);
+}
+
+// Called after cpu_interrupt() has gone through the vector
+void profile_interrupt(struct profiler *p, struct cpu_state *s) {
+  p->cycles += 7;
+  p->self += 7;
+  push_frame(p, physical_address(p->hw, s->pc), s->s + 3);
+}
+
+static void format_address(char *buffer, size_t size, uint32_t physical) {
+  if(physical == ROOT_ROUTINE)
+    snprintf(buffer, size, "reset");
+  else
+    snprintf(buffer, size, "%s:%06x", physical_region_name(physical), PHYSICAL_OFFSET(physical));
+}
+
+static int compare_counts(const void *a, const void *b) {
+  uint64_t x = ((const struct profile_counts*)a)->cycles, y = ((const struct profile_counts*)b)->cycles;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compare_edges(const void *a, const void *b) {
+  uint64_t x = ((const struct profile_edge*)a)->cycles, y = ((const struct profile_edge*)b)->cycles;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Writes prefix.txt with the flat profile and call edges, and prefix.folded
+// with one "caller;callee;... cycles" line per call stack for flame graphs
+int profiler_write(struct profiler *p, const char *prefix) {
+  char path[1024], name[32], name2[32];
+  flush_self(p);
+
+  snprintf(path, sizeof(path), "%s.txt", prefix);
+  FILE *file = fopen(path, "w");
+  if(!file) {
+    printf("Can't open %s for writing\n", path);
+    return -1;
+  }
+  struct profile_counts *counts = malloc((p->counts_used + 1) * sizeof(*counts));
+  struct profile_edge *edges = malloc((p->edges_used + 1) * sizeof(*edges));
+  if(!counts || !edges) {
+    free(counts);
+    free(edges);
+    fclose(file);
+    return -1;
+  }
+  size_t count_total = 0, edge_total = 0;
+  for(size_t i=0; i<p->counts_size; i++)
+    if(p->counts[i].instructions)
+      counts[count_total++] = p->counts[i];
+  for(size_t i=0; i<p->edges_size; i++)
+    if(p->edges[i].calls)
+      edges[edge_total++] = p->edges[i];
+  qsort(counts, count_total, sizeof(*counts), compare_counts);
+  qsort(edges, edge_total, sizeof(*edges), compare_edges);
+
+  double total = p->cycles ? p->cycles : 1;
+  fprintf(file, "# %llu cycles profiled\n", (unsigned long long)p->cycles);
+  fprintf(file, "# address        instructions       cycles      %%\n");
+  for(size_t i=0; i<count_total; i++) {
+    format_address(name, sizeof(name), counts[i].key);
+    fprintf(file, "%-14s %14llu %12llu %6.2f\n", name, (unsigned long long)counts[i].instructions,
+      (unsigned long long)counts[i].cycles, counts[i].cycles * 100 / total);
+  }
+  fprintf(file, "\n# caller         callee                calls    inclusive cycles      %%\n");
+  for(size_t i=0; i<edge_total; i++) {
+    format_address(name, sizeof(name), edges[i].caller);
+    format_address(name2, sizeof(name2), edges[i].callee);
+    fprintf(file, "%-14s %-14s %12llu %19llu %6.2f\n", name, name2, (unsigned long long)edges[i].calls,
+      (unsigned long long)edges[i].cycles, edges[i].cycles * 100 / total);
+  }
+  free(counts);
+  free(edges);
+  fclose(file);
+
+  snprintf(path, sizeof(path), "%s.folded", prefix);
+  if(!(file = fopen(path, "w"))) {
+    printf("Can't open %s for writing\n", path);
+    return -1;
+  }
+  for(size_t i=0; i<p->stacks_size; i++) {
+    struct profile_stack *t = &p->stacks[i];
+    if(!t->cycles)
+      continue;
+    fputs("reset", file);
+    for(int j=0; j<t->depth; j++) {
+      format_address(name, sizeof(name), t->frames[j]);
+      fprintf(file, ";%s", name);
+    }
+    fprintf(file, " %llu\n", (unsigned long long)t->cycles);
+  }
+  fclose(file);
+  return 0;
+}
+#endif
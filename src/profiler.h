@@ -0,0 +1,59 @@
+#ifndef MIUCHIZ_PROFILER_HEADER
+#define MIUCHIZ_PROFILER_HEADER
+#include "hardware.h"
+
+// Only built with -DMIUCHIZ_PROFILER (make PROFILER=1), and only runs once
+// cpu_state.profiler is set. Blocks aren't used while profiling, so every
+// instruction goes through run_instruction().
+
+#define PROFILER_DEPTH 64
+
+// per physical address of an instruction
+struct profile_counts {
+  uint32_t key; // physical_address(), which can be 0, so instructions == 0 marks a slot unused
+  uint64_t instructions, cycles;
+};
+
+// per JSR from one routine to another, with cycles including everything called
+struct profile_edge {
+  uint32_t caller, callee;
+  uint64_t calls, cycles;
+};
+
+// cycles spent with exactly this call stack on top, for flame graphs
+struct profile_stack {
+  uint32_t hash;
+  int depth;
+  uint32_t frames[PROFILER_DEPTH];
+  uint64_t cycles;
+};
+
+struct profile_frame {
+  uint32_t routine; // physical address of its first instruction
+  uint32_t hash;    // of the whole stack up to here
+  uint8_t sp;       // stack pointer once it returns
+  uint64_t start;   // profiler cycles when it was called
+};
+
+struct profiler {
+  struct miuchiz_hardware *hw;
+  uint64_t cycles; // all the cycles profiled so far
+  uint64_t self;   // cycles since the top of the stack last changed
+  struct profile_counts *counts;
+  struct profile_edge *edges;
+  struct profile_stack *stacks;
+  size_t counts_size, counts_used;
+  size_t edges_size, edges_used;
+  size_t stacks_size, stacks_used;
+  struct profile_frame frames[PROFILER_DEPTH];
+  int depth;
+};
+
+#ifdef MIUCHIZ_PROFILER
+int profiler_init(struct profiler *p, struct miuchiz_hardware *hw);
+void profiler_free(struct profiler *p);
+void profile_instruction(struct profiler *p, struct cpu_state *s, uint16_t pc, uint8_t opcode, int cycles);
+void profile_interrupt(struct profiler *p, struct cpu_state *s);
+int profiler_write(struct profiler *p, const char *prefix);
+#endif
+#endif
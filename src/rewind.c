@@ -0,0 +1,216 @@
+#include "rewind.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Deltas are encoded as (u16 zero run, u16 literal count, literal bytes)
+// groups. Literal runs only get broken up by zero runs long enough to pay
+// for another group header. Each entry is framed by its length on both
+// ends, so the ring can be popped from the newest end and trimmed from the
+// oldest.
+#define MIN_ZERO_RUN 4
+#define MAX_RUN 0xffff
+
+static void capture_state(struct rewind_state *state, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  state->a = cpu->a;
+  state->x = cpu->x;
+  state->y = cpu->y;
+  state->s = cpu->s;
+  state->flags = cpu_get_flags(cpu);
+  state->pc = cpu->pc;
+  state->waiting = cpu->waiting;
+  state->cycles = cpu->cycles;
+  state->BRR = hw->BRR;
+  state->PRR = hw->PRR;
+  state->DRR = hw->DRR;
+  state->cursor_x = hw->cursor_x;
+  state->cursor_y = hw->cursor_y;
+  state->cursor_odd = hw->cursor_odd;
+  state->read_value = hw->read_value;
+  state->pixel_buffer = hw->pixel_buffer;
+  state->flash_state = hw->flash_state;
+  state->flash_id = hw->flash_id;
+  state->io = hw->io;
+  state->scheduler = hw->scheduler;
+  memcpy(state->ram, hw->ram, sizeof(state->ram));
+  memcpy(state->pixels, hw->pixels, sizeof(state->pixels));
+}
+
+static void restore_state(struct rewind_state *state, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  cpu->a = state->a;
+  cpu->x = state->x;
+  cpu->y = state->y;
+  cpu->s = state->s;
+  cpu_set_flags(cpu, state->flags);
+  cpu->pc = state->pc;
+  cpu->waiting = state->waiting;
+  cpu->cycles = state->cycles;
+  hw->BRR = state->BRR;
+  hw->PRR = state->PRR;
+  hw->DRR = state->DRR;
+  hw->cursor_x = state->cursor_x;
+  hw->cursor_y = state->cursor_y;
+  hw->cursor_odd = state->cursor_odd;
+  hw->read_value = state->read_value;
+  hw->pixel_buffer = state->pixel_buffer;
+  hw->flash_state = state->flash_state;
+  hw->flash_id = state->flash_id;
+  hw->io = state->io;
+  hw->scheduler = state->scheduler;
+  memcpy(hw->ram, state->ram, sizeof(state->ram));
+  memcpy(hw->pixels, state->pixels, sizeof(state->pixels));
+  update_memory_map(hw);
+}
+
+static void put16(uint8_t *out, uint16_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+}
+
+static uint16_t get16(const uint8_t *in) {
+  return in[0] | (in[1] << 8);
+}
+
+// XORs a against b and run-length encodes the result, returns the size
+static size_t encode_delta(const uint8_t *a, const uint8_t *b, size_t size, uint8_t *out) {
+  size_t i = 0, length = 0;
+  while(i < size) {
+    size_t zeros = 0;
+    while(i < size && zeros < MAX_RUN && a[i] == b[i]) {
+      zeros++;
+      i++;
+    }
+
+    // literals go on until a run of unchanged bytes worth a new group
+    size_t start = i, literal = 0, same = 0;
+    while(i < size && literal < MAX_RUN) {
+      if(a[i] == b[i]) {
+        if(++same == MIN_ZERO_RUN) {
+          literal -= same - 1;
+          i -= same - 1;
+          break;
+        }
+      } else {
+        same = 0;
+      }
+      literal++;
+      i++;
+    }
+
+    put16(out + length, zeros);
+    put16(out + length + 2, literal);
+    length += 4;
+    for(size_t j = 0; j < literal; j++)
+      out[length + j] = a[start + j] ^ b[start + j];
+    length += literal;
+  }
+  return length;
+}
+
+static void apply_delta(uint8_t *state, size_t size, const uint8_t *in, size_t length) {
+  size_t i = 0, position = 0;
+  while(position + 4 <= length) {
+    i += get16(in + position);
+    size_t literal = get16(in + position + 2);
+    position += 4;
+    for(size_t j = 0; j < literal && i < size; j++, i++)
+      state[i] ^= in[position + j];
+    position += literal;
+  }
+}
+
+static void ring_write(struct rewind_buffer *r, size_t offset, const void *data, size_t size) {
+  size_t at = (r->start + offset) % r->capacity;
+  size_t first = r->capacity - at < size ? r->capacity - at : size;
+  memcpy(r->ring + at, data, first);
+  memcpy(r->ring, (const uint8_t*)data + first, size - first);
+}
+
+static void ring_read(struct rewind_buffer *r, size_t offset, void *data, size_t size) {
+  size_t at = (r->start + offset) % r->capacity;
+  size_t first = r->capacity - at < size ? r->capacity - at : size;
+  memcpy(data, r->ring + at, first);
+  memcpy((uint8_t*)data + first, r->ring, size - first);
+}
+
+static void drop_oldest(struct rewind_buffer *r) {
+  uint32_t length;
+  ring_read(r, 0, &length, sizeof(length));
+  size_t total = length + 2 * sizeof(length);
+  r->start = (r->start + total) % r->capacity;
+  r->used -= total;
+  r->entries--;
+}
+
+int rewind_init(struct rewind_buffer *r, size_t capacity, int interval) {
+  memset(r, 0, sizeof(*r));
+  r->ring = malloc(capacity);
+  // a group needs at least MIN_ZERO_RUN unchanged bytes to start, so an
+  // encoded delta can't get anywhere near twice the size of a state
+  r->scratch = malloc(sizeof(struct rewind_state) * 2 + 16);
+  if(!r->ring || !r->scratch) {
+    rewind_free(r);
+    return -1;
+  }
+  r->capacity = capacity;
+  r->interval = interval > 0 ? interval : 1;
+  return 0;
+}
+
+void rewind_free(struct rewind_buffer *r) {
+  free(r->ring);
+  free(r->scratch);
+  r->ring = r->scratch = NULL;
+}
+
+// Call once per emulated frame
+void rewind_frame(struct rewind_buffer *r, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  if(!r->ring || ++r->counter < r->interval)
+    return;
+  r->counter = 0;
+
+  struct rewind_state *next = &r->next;
+  capture_state(next, cpu, hw);
+  // flash isn't recorded, so states from before it changed can't be restored
+  if(!r->have_current || r->flash_writes != hw->image.flash_writes) {
+    r->start = r->used = r->entries = 0;
+    r->current = *next;
+    r->have_current = 1;
+    r->flash_writes = hw->image.flash_writes;
+    return;
+  }
+
+  uint32_t length = encode_delta((uint8_t*)&r->current, (uint8_t*)next, sizeof(*next), r->scratch);
+  size_t total = length + 2 * sizeof(length);
+  if(total <= r->capacity) {
+    while(r->capacity - r->used < total)
+      drop_oldest(r);
+    ring_write(r, r->used, &length, sizeof(length));
+    ring_write(r, r->used + sizeof(length), r->scratch, length);
+    ring_write(r, r->used + sizeof(length) + length, &length, sizeof(length));
+    r->used += total;
+    r->entries++;
+  } else {
+    // doesn't fit at all, so nothing older is reachable anymore
+    r->start = r->used = r->entries = 0;
+  }
+  r->current = *next;
+}
+
+// Goes back to the most recently recorded state and makes the one before
+// it current, returns 0 once there's nothing left to go back to
+int rewind_step(struct rewind_buffer *r, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  if(!r->ring || !r->have_current || r->flash_writes != hw->image.flash_writes)
+    return 0;
+  restore_state(&r->current, cpu, hw);
+  r->counter = 0;
+  if(!r->entries)
+    return 0;
+
+  uint32_t length;
+  ring_read(r, r->used - sizeof(length), &length, sizeof(length));
+  r->used -= length + 2 * sizeof(length);
+  ring_read(r, r->used + sizeof(length), r->scratch, length);
+  r->entries--;
+  apply_delta((uint8_t*)&r->current, sizeof(r->current), r->scratch, length);
+  return 1;
+}
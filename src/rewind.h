@@ -0,0 +1,42 @@
+#ifndef MIUCHIZ_REWIND_HEADER
+#define MIUCHIZ_REWIND_HEADER
+#include "hardware.h"
+
+// Everything rewind restores, flattened so states can be XORed together.
+// Flash contents aren't included since the firmware rarely changes them.
+// Instead the history is dropped whenever flash changes, so rewind can't
+// go back past a program or erase.
+struct rewind_state {
+  uint8_t a, x, y, s, flags;
+  uint16_t pc;
+  int waiting, cycles;
+  uint16_t BRR, PRR, DRR;
+  int cursor_x, cursor_y, cursor_odd;
+  uint8_t read_value, pixel_buffer;
+  uint8_t flash_state, flash_id;
+  struct miuchiz_io io;
+  struct miuchiz_scheduler scheduler;
+  uint8_t ram[0x8000];
+  uint16_t pixels[MIUCHIZ_HEIGHT][MIUCHIZ_WIDTH];
+};
+
+// Ring of run-length encoded XOR deltas, each one turning the state after
+// it into the state before it. Old entries are dropped to stay under the
+// memory cap.
+struct rewind_buffer {
+  uint8_t *ring;
+  size_t capacity, start, used;
+  int entries;
+  int interval, counter; // record every interval frames
+  int have_current;
+  uint32_t flash_writes; // miuchiz_images.flash_writes when current was recorded
+  struct rewind_state current; // most recently recorded state
+  struct rewind_state next;    // the state being recorded
+  uint8_t *scratch;
+};
+
+int rewind_init(struct rewind_buffer *r, size_t capacity, int interval);
+void rewind_free(struct rewind_buffer *r);
+void rewind_frame(struct rewind_buffer *r, struct cpu_state *cpu, struct miuchiz_hardware *hw);
+int rewind_step(struct rewind_buffer *r, struct cpu_state *cpu, struct miuchiz_hardware *hw);
+#endif
@@ -0,0 +1,341 @@
+#include "savestate.h"
+#include <stdlib.h>
+#include <string.h>
+
+// File layout, all little endian:
+//   "MIUCHIZS", u32 version, u32 flags, u64 sequence, u64 parent sequence,
+//   u64 miuchiz_flash_base_hash()
+//   CPU registers, bank registers, LCD state, pixels
+//   I/O registers, scheduler time, u8 event count, (u8 type, u64 time) each
+//   page records: u8 region, u32 page number, 256 bytes; ended by REGION_END
+// A keyframe stores the pages that differ from the image files (RAM starts
+// out zeroed). A delta stores the pages changed since its parent, and can
+// only be loaded on top of that parent, until flash is written after it.
+
+#define SAVESTATE_DELTA 1
+
+enum {
+  REGION_RAM,
+  REGION_FLASH,
+  REGION_END = 0xff
+};
+
+static void put8(FILE *file, uint8_t value) {
+  fputc(value, file);
+}
+
+static void put16(FILE *file, uint16_t value) {
+  put8(file, value);
+  put8(file, value >> 8);
+}
+
+static void put32(FILE *file, uint32_t value) {
+  put16(file, value);
+  put16(file, value >> 16);
+}
+
+static void put64(FILE *file, uint64_t value) {
+  put32(file, value);
+  put32(file, value >> 32);
+}
+
+static uint8_t get8(FILE *file) {
+  int c = fgetc(file);
+  return c == EOF ? 0 : c;
+}
+
+static uint16_t get16(FILE *file) {
+  uint16_t low = get8(file);
+  return (get8(file) << 8) | low;
+}
+
+static uint32_t get32(FILE *file) {
+  uint32_t low = get16(file);
+  return ((uint32_t)get16(file) << 16) | low;
+}
+
+static uint64_t get64(FILE *file) {
+  uint64_t low = get32(file);
+  return ((uint64_t)get32(file) << 32) | low;
+}
+
+static void put_page(FILE *file, int region, uint32_t page, const uint8_t *data) {
+  put8(file, region);
+  put32(file, page);
+  fwrite(data, 1, 256, file);
+}
+
+void savestate_init(struct savestate_tracker *t) {
+  memset(t, 0, sizeof(*t));
+}
+
+int savestate_save(struct savestate_tracker *t, struct cpu_state *cpu, struct miuchiz_hardware *hw, FILE *file, int delta) {
+  static const uint8_t zero_page[256];
+  struct miuchiz_images *image = &hw->image;
+  if(!t->sequence)
+    delta = 0;
+
+  fwrite("MIUCHIZS", 1, 8, file);
+  put32(file, SAVESTATE_VERSION);
+  put32(file, delta ? SAVESTATE_DELTA : 0);
+  put64(file, t->sequence + 1);
+  put64(file, delta ? t->sequence : 0);
+  put64(file, miuchiz_flash_base_hash(hw));
+
+  put8(file, cpu->a);
+  put8(file, cpu->x);
+  put8(file, cpu->y);
+  put8(file, cpu->s);
+  put8(file, cpu_get_flags(cpu));
+  put16(file, cpu->pc);
+  put32(file, cpu->waiting);
+  put32(file, cpu->cycles);
+
+  put16(file, hw->BRR);
+  put16(file, hw->PRR);
+  put16(file, hw->DRR);
+  put32(file, hw->cursor_x);
+  put32(file, hw->cursor_y);
+  put32(file, hw->cursor_odd);
+  put8(file, hw->read_value);
+  put8(file, hw->pixel_buffer);
+  for(int y = 0; y < MIUCHIZ_HEIGHT; y++)
+    for(int x = 0; x < MIUCHIZ_WIDTH; x++)
+      put16(file, hw->pixels[y][x]);
+
+  put16(file, hw->io.ireq);
+  put16(file, hw->io.iena);
+  for(int i = 0; i < MIUCHIZ_TIMERS; i++)
+    put16(file, hw->io.timer_reload[i]);
+  put8(file, hw->io.tien);
+  put8(file, hw->io.bten);
+  put8(file, hw->io.nmi);
+  for(int i = 0; i < MIUCHIZ_PSG_CHANNELS; i++)
+    put16(file, hw->io.psg_period[i]);
+  put8(file, hw->io.psg_volume[0]);
+  put8(file, hw->io.psg_volume[1]);
+  put8(file, hw->io.psgc);
+  put8(file, hw->io.psgm);
+  for(int i = 0; i < (int)sizeof(hw->io.regs); i++)
+    put8(file, hw->io.regs[i]);
+  put8(file, hw->flash_state);
+  put8(file, hw->flash_id);
+  put64(file, hw->scheduler.time);
+  put8(file, hw->scheduler.count);
+  for(int i = 0; i < hw->scheduler.count; i++) {
+    put8(file, hw->scheduler.queue[i].type);
+    put64(file, hw->scheduler.queue[i].time);
+  }
+
+  for(int page = 0; page < sizeof(hw->ram) / 256; page++) {
+    const uint8_t *compare = delta ? &t->ram[page * 256] : zero_page;
+    if(memcmp(&hw->ram[page * 256], compare, 256))
+      put_page(file, REGION_RAM, page, &hw->ram[page * 256]);
+  }
+  if(image->flash) {
+    int want = delta ? FLASH_PAGE_WRITTEN : FLASH_PAGE_MODIFIED;
+    for(int page = 0; page < MIUCHIZ_FLASH_PAGES; page++) {
+      if(image->flash_dirty[page] & want)
+        put_page(file, REGION_FLASH, page, &image->flash[page * 256]);
+    }
+  }
+  put8(file, REGION_END);
+
+  if(ferror(file)) {
+    puts("Can't write save state");
+    return -1;
+  }
+  // only now is this the parent of the next delta
+  t->sequence++;
+  memcpy(t->ram, hw->ram, sizeof(t->ram));
+  for(int page = 0; image->flash && page < MIUCHIZ_FLASH_PAGES; page++)
+    image->flash_dirty[page] &= ~FLASH_PAGE_WRITTEN;
+  return 0;
+}
+
+// A flash page from the file, held back until the whole file has checked out
+struct staged_page {
+  uint32_t page;
+  uint8_t data[256];
+};
+
+// Reads everything after the header into cpu and hw, which are scratch
+// copies, and the flash pages into *staged. Nothing outside them changes.
+static int decode(struct cpu_state *cpu, struct miuchiz_hardware *hw, FILE *file, struct staged_page **staged, int *staged_count) {
+  int capacity = 0;
+  cpu->a = get8(file);
+  cpu->x = get8(file);
+  cpu->y = get8(file);
+  cpu->s = get8(file);
+  cpu_set_flags(cpu, get8(file));
+  cpu->pc = get16(file);
+  cpu->waiting = get32(file);
+  cpu->cycles = get32(file);
+
+  hw->BRR = get16(file);
+  hw->PRR = get16(file);
+  hw->DRR = get16(file);
+  hw->cursor_x = get32(file);
+  hw->cursor_y = get32(file);
+  hw->cursor_odd = get32(file);
+  hw->read_value = get8(file);
+  hw->pixel_buffer = get8(file);
+  for(int y = 0; y < MIUCHIZ_HEIGHT; y++)
+    for(int x = 0; x < MIUCHIZ_WIDTH; x++)
+      hw->pixels[y][x] = get16(file);
+
+  hw->io.ireq = get16(file);
+  hw->io.iena = get16(file);
+  for(int i = 0; i < MIUCHIZ_TIMERS; i++)
+    hw->io.timer_reload[i] = get16(file);
+  hw->io.tien = get8(file);
+  hw->io.bten = get8(file);
+  hw->io.nmi = get8(file);
+  for(int i = 0; i < MIUCHIZ_PSG_CHANNELS; i++)
+    hw->io.psg_period[i] = get16(file);
+  hw->io.psg_volume[0] = get8(file);
+  hw->io.psg_volume[1] = get8(file);
+  hw->io.psgc = get8(file);
+  hw->io.psgm = get8(file);
+  for(int i = 0; i < (int)sizeof(hw->io.regs); i++)
+    hw->io.regs[i] = get8(file);
+  hw->flash_state = get8(file);
+  hw->flash_id = get8(file);
+  hw->scheduler.time = get64(file);
+  hw->scheduler.count = 0;
+  int events = get8(file);
+  // the LCD cursor indexes pixels[] directly, so it has to be in range
+  if(cpu->waiting < 0 || cpu->waiting > CPU_STOPPED || events > EVENT_COUNT ||
+     hw->cursor_x < 0 || hw->cursor_x >= MIUCHIZ_WIDTH || hw->cursor_y < 0 || hw->cursor_y >= MIUCHIZ_HEIGHT) {
+    puts("Save state is corrupt");
+    return -1;
+  }
+  for(int i = 0; i < events; i++) {
+    int type = get8(file);
+    uint64_t time = get64(file);
+    if(type >= EVENT_COUNT) {
+      puts("Save state is corrupt");
+      return -1;
+    }
+    schedule_event(hw, type, time);
+  }
+
+  while(1) {
+    int region = get8(file);
+    if(region == REGION_END || feof(file) || ferror(file))
+      break;
+    uint32_t page = get32(file);
+    uint8_t data[256];
+    if(fread(data, 1, 256, file) != 256)
+      break;
+    if(region == REGION_RAM && page < sizeof(hw->ram) / 256) {
+      memcpy(&hw->ram[page * 256], data, 256);
+    } else if(region == REGION_FLASH && hw->image.flash && page < MIUCHIZ_FLASH_PAGES) {
+      if(*staged_count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        struct staged_page *grown = realloc(*staged, capacity * sizeof(**staged));
+        if(!grown) {
+          puts("Not enough memory to load the save state");
+          return -1;
+        }
+        *staged = grown;
+      }
+      (*staged)[*staged_count].page = page;
+      memcpy((*staged)[*staged_count].data, data, 256);
+      (*staged_count)++;
+    }
+  }
+  if(ferror(file) || feof(file)) {
+    puts("Save state is truncated");
+    return -1;
+  }
+  return 0;
+}
+
+// The machine is only touched once the whole file has been read, so a
+// truncated or corrupt state leaves it as it was
+int savestate_load(struct savestate_tracker *t, struct cpu_state *cpu, struct miuchiz_hardware *hw, FILE *file) {
+  char magic[8];
+  if(fread(magic, 1, 8, file) != 8 || memcmp(magic, "MIUCHIZS", 8)) {
+    puts("Not a save state");
+    return -1;
+  }
+  uint32_t version = get32(file);
+  if(version != SAVESTATE_VERSION) {
+    printf("Unsupported save state version %u\n", version);
+    return -1;
+  }
+  uint32_t flags = get32(file);
+  uint64_t sequence = get64(file);
+  uint64_t parent = get64(file);
+  uint64_t base_hash = get64(file);
+  if((flags & SAVESTATE_DELTA) && parent != t->sequence) {
+    puts("Save state is a delta for a different state");
+    return -1;
+  }
+  // A delta's RAM is rebuilt from the tracker's copy of its parent, but
+  // there's no copy of the parent's flash, only the machine's. Once flash
+  // has been written since then, the pages the delta leaves out are wrong.
+  for(int page = 0; (flags & SAVESTATE_DELTA) && hw->image.flash && page < MIUCHIZ_FLASH_PAGES; page++) {
+    if(hw->image.flash_dirty[page] & FLASH_PAGE_WRITTEN) {
+      puts("Flash has been written since the state this delta builds on");
+      return -1;
+    }
+  }
+  // flash pages are stored against the image, so another one would garble them
+  if(base_hash != miuchiz_flash_base_hash(hw)) {
+    puts("Save state was made with a different flash image");
+    return -1;
+  }
+
+  struct miuchiz_hardware *scratch = malloc(sizeof(*scratch));
+  if(!scratch) {
+    puts("Not enough memory to load the save state");
+    return -1;
+  }
+  // a keyframe starts over with zeroed RAM, a delta builds on its parent's
+  memcpy(scratch, hw, sizeof(*scratch));
+  if(flags & SAVESTATE_DELTA)
+    memcpy(scratch->ram, t->ram, sizeof(scratch->ram));
+  else
+    memset(scratch->ram, 0, sizeof(scratch->ram));
+  struct cpu_state scratch_cpu = *cpu;
+  struct staged_page *staged = NULL;
+  int staged_count = 0;
+  if(decode(&scratch_cpu, scratch, file, &staged, &staged_count)) {
+    free(staged);
+    free(scratch);
+    return -1;
+  }
+
+  *cpu = scratch_cpu;
+  memcpy(hw, scratch, sizeof(*hw));
+  free(scratch);
+
+  // a keyframe starts over from the image files, and whatever flash that
+  // changes still has to reach the journal
+  struct miuchiz_images *image = &hw->image;
+  if(!(flags & SAVESTATE_DELTA)) {
+    for(int page = 0; image->flash && page < MIUCHIZ_FLASH_PAGES; page++) {
+      int modified = image->flash_dirty[page] & FLASH_PAGE_MODIFIED;
+      if(modified)
+        memcpy(&image->flash[page * 256], &image->flash_base[page * 256], 256);
+      image->flash_dirty[page] = (image->flash_dirty[page] & FLASH_PAGE_UNSAVED) | (modified ? FLASH_PAGE_UNSAVED : 0);
+    }
+  }
+  for(int i = 0; i < staged_count; i++) {
+    memcpy(&image->flash[staged[i].page * 256], staged[i].data, 256);
+    image->flash_dirty[staged[i].page] |= FLASH_PAGE_MODIFIED | FLASH_PAGE_UNSAVED;
+  }
+  free(staged);
+  if(!(flags & SAVESTATE_DELTA) || staged_count)
+    image->flash_writes++;
+
+  for(int page = 0; image->flash && page < MIUCHIZ_FLASH_PAGES; page++)
+    image->flash_dirty[page] &= ~FLASH_PAGE_WRITTEN;
+  flush_code_blocks(hw);
+  update_memory_map(hw);
+  t->sequence = sequence;
+  memcpy(t->ram, hw->ram, sizeof(t->ram));
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef MIUCHIZ_SAVESTATE_HEADER
+#define MIUCHIZ_SAVESTATE_HEADER
+#include "hardware.h"
+#include <stdio.h>
+
+#define SAVESTATE_VERSION 6
+
+// Keeps track of the last state saved or loaded, so the next one can be a
+// delta that only stores the RAM and flash pages changed since then
+struct savestate_tracker {
+  uint64_t sequence; // 0 if there's no previous state to build on
+  uint8_t ram[0x8000];
+};
+
+void savestate_init(struct savestate_tracker *t);
+int savestate_save(struct savestate_tracker *t, struct cpu_state *cpu, struct miuchiz_hardware *hw, FILE *file, int delta);
+int savestate_load(struct savestate_tracker *t, struct cpu_state *cpu, struct miuchiz_hardware *hw, FILE *file);
+#endif
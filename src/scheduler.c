@@ -0,0 +1,194 @@
+#include "hardware.h"
+#include "debugger.h"
+
+// Timers count at the CPU clock divided by this
+#define TIMER_PRESCALE 16
+// How often a request that's waiting on the I flag gets checked for, since
+// CLI and friends can't end a slice themselves
+#define IRQ_POLL_CYCLES 256
+
+// Base timer rate for each BTEN bit, in Hz. Only the fastest enabled one is used
+static const int base_timer_rates[8] = {2, 4, 8, 16, 32, 64, 128, 256};
+
+static void swap_events(struct miuchiz_scheduler *s, int a, int b) {
+  struct miuchiz_event temp = s->queue[a];
+  s->queue[a] = s->queue[b];
+  s->queue[b] = temp;
+}
+
+static void sift_up(struct miuchiz_scheduler *s, int i) {
+  while(i > 0) {
+    int parent = (i - 1) / 2;
+    if(s->queue[parent].time <= s->queue[i].time)
+      break;
+    swap_events(s, i, parent);
+    i = parent;
+  }
+}
+
+static void sift_down(struct miuchiz_scheduler *s, int i) {
+  while(1) {
+    int smallest = i, left = i * 2 + 1, right = i * 2 + 2;
+    if(left < s->count && s->queue[left].time < s->queue[smallest].time)
+      smallest = left;
+    if(right < s->count && s->queue[right].time < s->queue[smallest].time)
+      smallest = right;
+    if(smallest == i)
+      break;
+    swap_events(s, i, smallest);
+    i = smallest;
+  }
+}
+
+static void remove_event(struct miuchiz_scheduler *s, int i) {
+  s->queue[i] = s->queue[--s->count];
+  if(i < s->count) {
+    sift_down(s, i);
+    sift_up(s, i);
+  }
+}
+
+// Absolute cycle count, including the instruction that's running right now
+uint64_t current_time(struct miuchiz_hardware *hw) {
+  return hw->scheduler.time + hw->cpu->cycles;
+}
+
+// Makes run_cycles() return after the current instruction without changing
+// the time, so miuchiz_run() can look at the event queue again
+void end_slice(struct miuchiz_hardware *hw) {
+  hw->scheduler.time += hw->cpu->cycles;
+  hw->cpu->cycles = 0;
+}
+
+void cancel_event(struct miuchiz_hardware *hw, int type) {
+  struct miuchiz_scheduler *s = &hw->scheduler;
+  for(int i=0; i<s->count; i++)
+    if(s->queue[i].type == type) {
+      remove_event(s, i);
+      return;
+    }
+}
+
+// Replaces any event of the same type that's already in the queue
+void schedule_event(struct miuchiz_hardware *hw, int type, uint64_t time) {
+  struct miuchiz_scheduler *s = &hw->scheduler;
+  cancel_event(hw, type);
+  s->queue[s->count].time = time;
+  s->queue[s->count].type = type;
+  sift_up(s, s->count++);
+}
+
+int event_scheduled(struct miuchiz_hardware *hw, int type) {
+  for(int i=0; i<hw->scheduler.count; i++)
+    if(hw->scheduler.queue[i].type == type)
+      return 1;
+  return 0;
+}
+
+static uint64_t timer_period(struct miuchiz_hardware *hw, int timer) {
+  return (0x10000 - hw->io.timer_reload[timer]) * TIMER_PRESCALE;
+}
+
+static uint64_t base_timer_period(struct miuchiz_hardware *hw) {
+  for(int i=7; i>=0; i--)
+    if(hw->io.bten & (1 << i))
+      return MIUCHIZ_CPU_CLOCK / base_timer_rates[i];
+  return 0;
+}
+
+// Starts or stops the timers to match TIEN and BTEN. Bit n of restart makes
+// timer n start a new period even if it was already running, and bit
+// MIUCHIZ_TIMERS does the same for the base timer.
+void update_timers(struct miuchiz_hardware *hw, int restart) {
+  uint64_t now = current_time(hw);
+  for(int i=0; i<MIUCHIZ_TIMERS; i++) {
+    if(!(hw->io.tien & (1 << i)))
+      cancel_event(hw, EVENT_TIMER0 + i);
+    else if((restart & (1 << i)) || !event_scheduled(hw, EVENT_TIMER0 + i))
+      schedule_event(hw, EVENT_TIMER0 + i, now + timer_period(hw, i));
+  }
+  if(!hw->io.bten)
+    cancel_event(hw, EVENT_BASE_TIMER);
+  else if((restart & (1 << MIUCHIZ_TIMERS)) || !event_scheduled(hw, EVENT_BASE_TIMER))
+    schedule_event(hw, EVENT_BASE_TIMER, now + base_timer_period(hw));
+}
+
+void reset_scheduler(struct miuchiz_hardware *hw) {
+  hw->scheduler.time = 0;
+  hw->scheduler.count = 0;
+  schedule_event(hw, EVENT_LCD_FRAME, MIUCHIZ_CYCLES_PER_FRAME);
+}
+
+static void run_event(struct miuchiz_hardware *hw, struct miuchiz_event event) {
+  switch(event.type) {
+    case EVENT_LCD_FRAME:
+      hw->io.ireq |= IRQ_LCD_FRAME;
+      schedule_event(hw, EVENT_LCD_FRAME, event.time + MIUCHIZ_CYCLES_PER_FRAME);
+      break;
+    case EVENT_BASE_TIMER:
+      hw->io.ireq |= IRQ_BASE_TIMER;
+      schedule_event(hw, EVENT_BASE_TIMER, event.time + base_timer_period(hw));
+      break;
+    default: {
+      int timer = event.type - EVENT_TIMER0;
+      hw->io.ireq |= IRQ_TIMER0 << timer;
+      schedule_event(hw, event.type, event.time + timer_period(hw, timer));
+      break;
+    }
+  }
+}
+
+static void check_interrupts(struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  if(cpu->waiting == CPU_STOPPED)
+    return;
+  if(hw->io.nmi) {
+    hw->io.nmi = 0;
+    cpu->waiting = 0;
+    cpu_interrupt(cpu, 0xfffa);
+    return;
+  }
+  if(hw->io.ireq & hw->io.iena) {
+    // WAI wakes up even if the I flag keeps the interrupt from being taken
+    cpu->waiting = 0;
+    if(!(cpu->flags & FLAG_NO_IRQ))
+      cpu_interrupt(cpu, 0xfffe);
+  }
+}
+
+// Runs the CPU and everything else for the given number of cycles, in slices
+// that end at the next event. Returns how many instructions were run.
+int miuchiz_run(struct cpu_state *cpu, struct miuchiz_hardware *hw, int cycles) {
+  struct miuchiz_scheduler *s = &hw->scheduler;
+  uint64_t end = s->time + cycles;
+  int instructions = 0;
+  // stopped at a breakpoint or watchpoint until debugger_continue()
+  if(cpu->debugger && cpu->debugger->hit)
+    return 0;
+
+  while(1) {
+    uint64_t now = current_time(hw);
+    while(s->count && s->queue[0].time <= now) {
+      struct miuchiz_event event = s->queue[0];
+      remove_event(s, 0);
+      run_event(hw, event);
+    }
+    check_interrupts(cpu, hw);
+
+    now = current_time(hw);
+    if(now >= end)
+      break;
+    uint64_t stop = end;
+    if(s->count && s->queue[0].time < stop)
+      stop = s->queue[0].time;
+    if((hw->io.ireq & hw->io.iena) && !cpu->waiting && stop - now > IRQ_POLL_CYCLES)
+      stop = now + IRQ_POLL_CYCLES;
+
+    int slice = stop - s->time;
+    s->time += slice;
+    instructions += run_cycles(cpu, slice);
+    if(cpu->debugger && cpu->debugger->hit)
+      break;
+  }
+  sound_update(hw);
+  return instructions;
+}
@@ -0,0 +1,83 @@
+#include "hardware.h"
+#include <string.h>
+
+// The PSG, as far as it's understood. Registers:
+//   $10-$17 PSG0L-PSG3H  period of each channel's square wave, in units of
+//                        PSG_PRESCALE cycles per half wave, minus one
+//   $18     VOLL         channel 0 volume in the low nibble, channel 1 in the high
+//   $19     VOLH         channels 2 and 3
+//   $1a     PSGC         bit n turns channel n on
+//   $1b     PSGM         bit n makes channel n a DAC that plays PSGnL as a signed sample
+// None of this has been checked against a real unit yet.
+
+#define PSG_PRESCALE 16
+#define CHANNEL_GAIN 512 // per step of volume, so four channels at full volume don't clip
+
+// Sets how many samples per second sound_update() makes, or 0 for none.
+// The frontend can nudge this to keep its buffer from running dry or over.
+void sound_set_rate(struct miuchiz_hardware *hw, uint32_t rate) {
+  struct miuchiz_sound *s = &hw->sound;
+  s->rate = rate;
+  s->cycles_per_sample = rate ? ((uint64_t)MIUCHIZ_CPU_CLOCK << 16) / rate : 0;
+}
+
+static int channel_volume(struct miuchiz_hardware *hw, int channel) {
+  return (hw->io.psg_volume[channel >> 1] >> ((channel & 1) * 4)) & 15;
+}
+
+// cycles is 16.16 fixed point, like the phases
+static int16_t mix_sample(struct miuchiz_hardware *hw, uint32_t cycles) {
+  struct miuchiz_sound *s = &hw->sound;
+  struct miuchiz_io *io = &hw->io;
+  int mix = 0;
+  for(int i=0; i<MIUCHIZ_PSG_CHANNELS; i++) {
+    if(!(io->psgc & (1 << i)))
+      continue;
+    int volume = channel_volume(hw, i);
+    if(io->psgm & (1 << i)) {
+      mix += (int8_t)io->psg_period[i] * volume * CHANNEL_GAIN / 128;
+      continue;
+    }
+    // flip the output once for every half wave that went by
+    uint64_t half = (uint64_t)(io->psg_period[i] + 1) * PSG_PRESCALE << 16;
+    s->phase[i] += cycles;
+    if(s->phase[i] >= half) {
+      if((s->phase[i] / half) & 1)
+        s->level ^= 1 << i;
+      s->phase[i] %= half;
+    }
+    mix += (s->level & (1 << i)) ? volume * CHANNEL_GAIN : -volume * CHANNEL_GAIN;
+  }
+  return mix;
+}
+
+// Makes samples for the cycles run since the last call. Called before
+// anything changes the sound registers and at the end of miuchiz_run().
+void sound_update(struct miuchiz_hardware *hw) {
+  struct miuchiz_sound *s = &hw->sound;
+  uint64_t now = current_time(hw);
+  // going back in time or far ahead means a state was loaded or rewound
+  if(!s->rate || now < s->time || now - s->time > MIUCHIZ_CPU_CLOCK / 4) {
+    s->time = now;
+    return;
+  }
+  uint64_t elapsed = ((now - s->time) << 16) + s->remainder;
+  s->time = now;
+  while(elapsed >= s->cycles_per_sample) {
+    elapsed -= s->cycles_per_sample;
+    int16_t sample = mix_sample(hw, s->cycles_per_sample);
+    if(s->count < SOUND_BUFFER)
+      s->samples[s->count++] = sample;
+  }
+  s->remainder = elapsed;
+}
+
+// Moves up to max samples out of the buffer, oldest first
+int sound_take(struct miuchiz_hardware *hw, int16_t *dest, int max) {
+  struct miuchiz_sound *s = &hw->sound;
+  int count = s->count < max ? s->count : max;
+  memcpy(dest, s->samples, count * sizeof(*dest));
+  memmove(s->samples, s->samples + count, (s->count - count) * sizeof(*dest));
+  s->count -= count;
+  return count;
+}
@@ -0,0 +1,177 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void record_access(struct trace_buffer *t, uint16_t address, uint8_t value, int write) {
+  struct trace_record *r = t->current;
+  if(!r)
+    return;
+  if(r->bus_count < TRACE_BUS) {
+    r->bus[r->bus_count].address = address;
+    r->bus[r->bus_count].value = value;
+    r->bus[r->bus_count].write = write;
+  }
+  if(r->bus_count < 255)
+    r->bus_count++;
+}
+
+static uint8_t trace_read(void *h, uint16_t address) {
+  struct trace_buffer *t = h;
+  uint8_t value = t->read(t->hardware, address);
+  record_access(t, address, value, 0);
+  return value;
+}
+
+static void trace_write(void *h, uint16_t address, uint8_t value) {
+  struct trace_buffer *t = h;
+  record_access(t, address, value, 1);
+  t->write(t->hardware, address, value);
+}
+
+int trace_init(struct trace_buffer *t, size_t capacity) {
+  memset(t, 0, sizeof(*t));
+  t->records = calloc(capacity, sizeof(*t->records));
+  if(!t->records)
+    return -1;
+  t->capacity = capacity;
+  return 0;
+}
+
+void trace_free(struct trace_buffer *t) {
+  trace_stop(t);
+  free(t->records);
+  t->records = NULL;
+}
+
+// The debugger puts its watchpoint handlers in underneath these, in what
+// trace_start() replaced, so the trace's stay outermost
+void trace_start(struct trace_buffer *t, struct cpu_state *cpu, struct miuchiz_hardware *hw) {
+  if(t->cpu)
+    return;
+  t->cpu = cpu;
+  t->hw = hw;
+  t->hardware = cpu->hardware;
+  t->read = cpu->read;
+  t->write = cpu->write;
+  t->code_map = cpu->code_map;
+  t->skip_idle = cpu->skip_idle;
+  t->current = NULL;
+  cpu->hardware = t;
+  cpu->read = trace_read;
+  cpu->write = trace_write;
+  cpu->code_map = NULL;
+  cpu->skip_idle = 0;
+  cpu->trace = t;
+}
+
+void trace_stop(struct trace_buffer *t) {
+  struct cpu_state *cpu = t->cpu;
+  if(!cpu)
+    return;
+  cpu->hardware = t->hardware;
+  cpu->read = t->read;
+  cpu->write = t->write;
+  cpu->code_map = t->code_map;
+  cpu->skip_idle = t->skip_idle;
+  cpu->trace = NULL;
+  t->cpu = NULL;
+  t->current = NULL;
+}
+
+static struct trace_record *new_record(struct trace_buffer *t, int type, uint16_t pc) {
+  struct cpu_state *cpu = t->cpu;
+  struct miuchiz_hardware *hw = t->hw;
+  struct trace_record *r = &t->records[t->total++ % t->capacity];
+  r->time = current_time(hw);
+  r->physical = physical_address(hw, pc);
+  r->pc = pc;
+  r->BRR = hw->BRR;
+  r->PRR = hw->PRR;
+  r->DRR = hw->DRR;
+  r->type = type;
+  r->a = cpu->a;
+  r->x = cpu->x;
+  r->y = cpu->y;
+  r->s = cpu->s;
+  r->flags = cpu_get_flags(cpu);
+  r->bus_count = 0;
+  t->current = r;
+  return r;
+}
+
+// The opcode and operands are about to be fetched, which aren't bus
+// accesses worth keeping
+void trace_fetch(struct trace_buffer *t) {
+  t->current = NULL;
+}
+
+// Starts a record for the instruction at pc, once its operands are fetched
+void trace_instruction(struct trace_buffer *t, uint16_t pc, uint8_t opcode) {
+  struct trace_record *r = new_record(t, TRACE_INSTRUCTION, pc);
+  r->opcode = opcode;
+  r->operand[0] = t->cpu->fetched[0];
+  r->operand[1] = t->cpu->fetched[1];
+}
+
+void trace_interrupt(struct trace_buffer *t, uint16_t vector) {
+  struct trace_record *r = new_record(t, TRACE_INTERRUPT, t->cpu->pc);
+  r->opcode = vector;
+  r->operand[0] = r->operand[1] = 0;
+}
+
+static void put(uint8_t **p, uint64_t value, int bytes) {
+  for(int i=0; i<bytes; i++)
+    *(*p)++ = value >> (i * 8);
+}
+
+// Writes out the ring oldest record first, see trace.h for the format
+int trace_dump(struct trace_buffer *t, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if(!file) {
+    printf("Can't open %s for writing\n", path);
+    return -1;
+  }
+  uint64_t count = t->total < t->capacity ? t->total : t->capacity;
+  uint8_t header[20], *p = header;
+  memcpy(p, "MIUCHIZT", 8);
+  p += 8;
+  put(&p, TRACE_VERSION, 4);
+  put(&p, count, 8);
+  fwrite(header, 1, sizeof(header), file);
+
+  for(uint64_t i = t->total - count; i < t->total; i++) {
+    struct trace_record *r = &t->records[i % t->capacity];
+    uint8_t buffer[TRACE_RECORD_SIZE];
+    p = buffer;
+    put(&p, r->time, 8);
+    put(&p, r->physical, 4);
+    put(&p, r->pc, 2);
+    put(&p, r->BRR, 2);
+    put(&p, r->PRR, 2);
+    put(&p, r->DRR, 2);
+    put(&p, r->type, 1);
+    put(&p, r->opcode, 1);
+    put(&p, r->operand[0], 1);
+    put(&p, r->operand[1], 1);
+    put(&p, r->a, 1);
+    put(&p, r->x, 1);
+    put(&p, r->y, 1);
+    put(&p, r->s, 1);
+    put(&p, r->flags, 1);
+    put(&p, r->bus_count, 1);
+    for(int j=0; j<TRACE_BUS; j++) {
+      put(&p, r->bus[j].address, 2);
+      put(&p, r->bus[j].value, 1);
+      put(&p, r->bus[j].write, 1);
+    }
+    fwrite(buffer, 1, sizeof(buffer), file);
+  }
+  if(ferror(file)) {
+    printf("Can't write %s\n", path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
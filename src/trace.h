@@ -0,0 +1,60 @@
+#ifndef MIUCHIZ_TRACE_HEADER
+#define MIUCHIZ_TRACE_HEADER
+#include "hardware.h"
+
+// Trace files are "MIUCHIZT", u32 version, u64 record count, then the
+// records oldest first, each TRACE_RECORD_SIZE bytes little endian in the
+// order of struct trace_record. See tracedump.c for a reader.
+#define TRACE_VERSION 1
+#define TRACE_BUS 5 // bus accesses kept per record, more are counted but dropped
+#define TRACE_RECORD_SIZE (8 + 4 + 2*4 + 4 + 5 + 1 + TRACE_BUS*4)
+
+enum {
+  TRACE_INSTRUCTION,
+  TRACE_INTERRUPT // opcode is the low byte of the vector
+};
+
+struct trace_access {
+  uint16_t address;
+  uint8_t value;
+  uint8_t write;
+};
+
+struct trace_record {
+  uint64_t time;     // cycle count when it started
+  uint32_t physical; // physical_address() of the PC
+  uint16_t pc, BRR, PRR, DRR;
+  uint8_t type, opcode, operand[2];
+  uint8_t a, x, y, s, flags; // before it ran
+  uint8_t bus_count;
+  struct trace_access bus[TRACE_BUS];
+};
+
+// Fixed size ring of the most recent instructions. While tracing, the CPU's
+// bus handlers are swapped for ones that record each access, and the block
+// cache and idle loop skipping are turned off so every instruction shows up.
+struct trace_buffer {
+  struct trace_record *records;
+  size_t capacity;
+  uint64_t total;                // records written, wrapping around the ring
+  struct trace_record *current;  // gets the bus accesses, NULL while fetching
+  struct cpu_state *cpu;
+  struct miuchiz_hardware *hw;
+
+  // what trace_start() replaced
+  void *hardware;
+  void (*write)(void*, uint16_t, uint8_t);
+  uint8_t (*read)(void*, uint16_t);
+  uint8_t **code_map;
+  int skip_idle;
+};
+
+int trace_init(struct trace_buffer *t, size_t capacity);
+void trace_free(struct trace_buffer *t);
+void trace_start(struct trace_buffer *t, struct cpu_state *cpu, struct miuchiz_hardware *hw);
+void trace_stop(struct trace_buffer *t);
+void trace_fetch(struct trace_buffer *t);
+void trace_instruction(struct trace_buffer *t, uint16_t pc, uint8_t opcode);
+void trace_interrupt(struct trace_buffer *t, uint16_t vector);
+int trace_dump(struct trace_buffer *t, const char *path);
+#endif
@@ -0,0 +1,172 @@
+// Prints a trace file from trace_dump() as a disassembled listing
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, IZP, IAX, REL, ZPR
+};
+
+static const char *mnemonics[256] = {
+/* 0x00 */ "brk", "ora", "nop", "nop", "tsb", "ora", "asl", "rmb0", "php", "ora", "asl", "nop", "tsb", "ora", "asl", "bbr0",
+/* 0x10 */ "bpl", "ora", "ora", "nop", "trb", "ora", "asl", "rmb1", "clc", "ora", "inc", "nop", "trb", "ora", "asl", "bbr1",
+/* 0x20 */ "jsr", "and", "nop", "nop", "bit", "and", "rol", "rmb2", "plp", "and", "rol", "nop", "bit", "and", "rol", "bbr2",
+/* 0x30 */ "bmi", "and", "and", "nop", "bit", "and", "rol", "rmb3", "sec", "and", "dec", "nop", "bit", "and", "rol", "bbr3",
+/* 0x40 */ "rti", "eor", "nop", "nop", "nop", "eor", "lsr", "rmb4", "pha", "eor", "lsr", "nop", "jmp", "eor", "lsr", "bbr4",
+/* 0x50 */ "bvc", "eor", "eor", "nop", "nop", "eor", "lsr", "rmb5", "cli", "eor", "phy", "nop", "nop", "eor", "lsr", "bbr5",
+/* 0x60 */ "rts", "adc", "nop", "nop", "stz", "adc", "ror", "rmb6", "pla", "adc", "ror", "nop", "jmp", "adc", "ror", "bbr6",
+/* 0x70 */ "bvs", "adc", "adc", "nop", "stz", "adc", "ror", "rmb7", "sei", "adc", "ply", "nop", "jmp", "adc", "ror", "bbr7",
+/* 0x80 */ "bra", "sta", "nop", "nop", "sty", "sta", "stx", "smb0", "dey", "bit", "txa", "nop", "sty", "sta", "stx", "bbs0",
+/* 0x90 */ "bcc", "sta", "sta", "nop", "sty", "sta", "stx", "smb1", "tya", "sta", "txs", "nop", "stz", "sta", "stz", "bbs1",
+/* 0xa0 */ "ldy", "lda", "ldx", "nop", "ldy", "lda", "ldx", "smb2", "tay", "lda", "tax", "nop", "ldy", "lda", "ldx", "bbs2",
+/* 0xb0 */ "bcs", "lda", "lda", "nop", "ldy", "lda", "ldx", "smb3", "clv", "lda", "tsx", "nop", "ldy", "lda", "ldx", "bbs3",
+/* 0xc0 */ "cpy", "cmp", "nop", "nop", "cpy", "cmp", "dec", "smb4", "iny", "cmp", "dex", "wai", "cpy", "cmp", "dec", "bbs4",
+/* 0xd0 */ "bne", "cmp", "cmp", "nop", "nop", "cmp", "dec", "smb5", "cld", "cmp", "phx", "stp", "nop", "cmp", "dec", "bbs5",
+/* 0xe0 */ "cpx", "sbc", "nop", "nop", "cpx", "sbc", "inc", "smb6", "inx", "sbc", "nop", "nop", "cpx", "sbc", "inc", "bbs6",
+/* 0xf0 */ "beq", "sbc", "sbc", "nop", "nop", "sbc", "inc", "smb7", "sed", "sbc", "plx", "nop", "nop", "sbc", "inc", "bbs7",
+};
+
+// the two and three byte NOPs skip their operands without fetching them,
+// so they're listed as implied
+static const uint8_t modes[256] = {
+/* 0x00 */ IMP, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, ACC, IMP, ABS, ABS, ABS, ZPR,
+/* 0x10 */ REL, IZY, IZP, IMP, ZP,  ZPX, ZPX, ZP,  IMP, ABY, ACC, IMP, ABS, ABX, ABX, ZPR,
+/* 0x20 */ ABS, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, ACC, IMP, ABS, ABS, ABS, ZPR,
+/* 0x30 */ REL, IZY, IZP, IMP, ZPX, ZPX, ZPX, ZP,  IMP, ABY, ACC, IMP, ABX, ABX, ABX, ZPR,
+/* 0x40 */ IMP, IZX, IMP, IMP, IMP, ZP,  ZP,  ZP,  IMP, IMM, ACC, IMP, ABS, ABS, ABS, ZPR,
+/* 0x50 */ REL, IZY, IZP, IMP, IMP, ZPX, ZPX, ZP,  IMP, ABY, IMP, IMP, IMP, ABX, ABX, ZPR,
+/* 0x60 */ IMP, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, ACC, IMP, IND, ABS, ABS, ZPR,
+/* 0x70 */ REL, IZY, IZP, IMP, ZPX, ZPX, ZPX, ZP,  IMP, ABY, IMP, IMP, IAX, ABX, ABX, ZPR,
+/* 0x80 */ REL, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, IMP, IMP, ABS, ABS, ABS, ZPR,
+/* 0x90 */ REL, IZY, IZP, IMP, ZPX, ZPX, ZPY, ZP,  IMP, ABY, IMP, IMP, ABS, ABX, ABX, ZPR,
+/* 0xa0 */ IMM, IZX, IMM, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, IMP, IMP, ABS, ABS, ABS, ZPR,
+/* 0xb0 */ REL, IZY, IZP, IMP, ZPX, ZPX, ZPY, ZP,  IMP, ABY, IMP, IMP, ABX, ABX, ABY, ZPR,
+/* 0xc0 */ IMM, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, IMP, IMP, ABS, ABS, ABS, ZPR,
+/* 0xd0 */ REL, IZY, IZP, IMP, IMP, ZPX, ZPX, ZP,  IMP, ABY, IMP, IMP, IMP, ABX, ABX, ZPR,
+/* 0xe0 */ IMM, IZX, IMP, IMP, ZP,  ZP,  ZP,  ZP,  IMP, IMM, IMP, IMP, ABS, ABS, ABS, ZPR,
+/* 0xf0 */ REL, IZY, IZP, IMP, IMP, ZPX, ZPX, ZP,  IMP, ABY, IMP, IMP, IMP, ABX, ABX, ZPR,
+};
+
+static const int operand_bytes[] = {
+  [IMP] = 0, [ACC] = 0, [IMM] = 1, [ZP] = 1, [ZPX] = 1, [ZPY] = 1, [ABS] = 2, [ABX] = 2,
+  [ABY] = 2, [IND] = 2, [IZX] = 1, [IZY] = 1, [IZP] = 1, [IAX] = 2, [REL] = 1, [ZPR] = 2,
+};
+
+static const char *region_names[] = {"none", "ram", "otp", "video", "flash"};
+
+static uint64_t get(const uint8_t **p, int bytes) {
+  uint64_t value = 0;
+  for(int i=0; i<bytes; i++)
+    value |= (uint64_t)*(*p)++ << (i * 8);
+  return value;
+}
+
+static void disassemble(char *out, size_t size, const struct trace_record *r) {
+  int mode = modes[r->opcode];
+  uint16_t word = r->operand[0] | (r->operand[1] << 8);
+  uint16_t next = r->pc + 1 + operand_bytes[mode];
+  const char *name = mnemonics[r->opcode];
+  switch(mode) {
+    case IMP: snprintf(out, size, "%s", name); break;
+    case ACC: snprintf(out, size, "%s a", name); break;
+    case IMM: snprintf(out, size, "%s #$%.2x", name, r->operand[0]); break;
+    case ZP:  snprintf(out, size, "%s $%.2x", name, r->operand[0]); break;
+    case ZPX: snprintf(out, size, "%s $%.2x,x", name, r->operand[0]); break;
+    case ZPY: snprintf(out, size, "%s $%.2x,y", name, r->operand[0]); break;
+    case ABS: snprintf(out, size, "%s $%.4x", name, word); break;
+    case ABX: snprintf(out, size, "%s $%.4x,x", name, word); break;
+    case ABY: snprintf(out, size, "%s $%.4x,y", name, word); break;
+    case IND: snprintf(out, size, "%s ($%.4x)", name, word); break;
+    case IZX: snprintf(out, size, "%s ($%.2x,x)", name, r->operand[0]); break;
+    case IZY: snprintf(out, size, "%s ($%.2x),y", name, r->operand[0]); break;
+    case IZP: snprintf(out, size, "%s ($%.2x)", name, r->operand[0]); break;
+    case IAX: snprintf(out, size, "%s ($%.4x,x)", name, word); break;
+    case REL: snprintf(out, size, "%s $%.4x", name, (uint16_t)(next + (int8_t)r->operand[0])); break;
+    case ZPR: snprintf(out, size, "%s $%.2x,$%.4x", name, r->operand[0], (uint16_t)(next + (int8_t)r->operand[1])); break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if(argc != 2) {
+    printf("usage: %s trace-file\n", argv[0]);
+    return -1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if(!file) {
+    printf("Can't open %s\n", argv[1]);
+    return -1;
+  }
+  uint8_t header[20];
+  const uint8_t *p = header + 8;
+  if(fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "MIUCHIZT", 8)) {
+    puts("Not a trace file");
+    return -1;
+  }
+  uint32_t version = get(&p, 4);
+  if(version != TRACE_VERSION) {
+    printf("Unsupported trace version %u\n", version);
+    return -1;
+  }
+  uint64_t count = get(&p, 8);
+
+  printf("%12s  %-12s %-4s  %-8s  %-18s %-2s %-2s %-2s %-2s %-8s  %s\n",
+    "cycle", "physical", "pc", "bytes", "instruction", "a", "x", "y", "s", "nv-bdizc", "bus");
+  for(uint64_t i=0; i<count; i++) {
+    uint8_t buffer[TRACE_RECORD_SIZE];
+    if(fread(buffer, 1, sizeof(buffer), file) != sizeof(buffer)) {
+      puts("Trace file is truncated");
+      return -1;
+    }
+    struct trace_record r;
+    p = buffer;
+    r.time = get(&p, 8);
+    r.physical = get(&p, 4);
+    r.pc = get(&p, 2);
+    r.BRR = get(&p, 2);
+    r.PRR = get(&p, 2);
+    r.DRR = get(&p, 2);
+    r.type = get(&p, 1);
+    r.opcode = get(&p, 1);
+    r.operand[0] = get(&p, 1);
+    r.operand[1] = get(&p, 1);
+    r.a = get(&p, 1);
+    r.x = get(&p, 1);
+    r.y = get(&p, 1);
+    r.s = get(&p, 1);
+    r.flags = get(&p, 1);
+    r.bus_count = get(&p, 1);
+    for(int j=0; j<TRACE_BUS; j++) {
+      r.bus[j].address = get(&p, 2);
+      r.bus[j].value = get(&p, 1);
+      r.bus[j].write = get(&p, 1);
+    }
+
+    char physical[24], bytes[16], text[32], flags[9];
+    int region = r.physical >> 24;
+    snprintf(physical, sizeof(physical), "%s:%.6x", region <= 4 ? region_names[region] : "?", r.physical & 0xffffff);
+    if(r.type == TRACE_INTERRUPT) {
+      bytes[0] = 0;
+      snprintf(text, sizeof(text), "-- %s --", r.opcode == 0xfa ? "nmi" : "irq");
+    } else {
+      int length = operand_bytes[modes[r.opcode]];
+      snprintf(bytes, sizeof(bytes), "%.2x", r.opcode);
+      for(int j=0; j<length; j++)
+        snprintf(bytes + 2 + j * 3, sizeof(bytes) - 2 - j * 3, " %.2x", r.operand[j]);
+      disassemble(text, sizeof(text), &r);
+    }
+    for(int j=0; j<8; j++)
+      flags[j] = (r.flags & (0x80 >> j)) ? "nv-bdizc"[j] : '.';
+    flags[8] = 0;
+
+    printf("%12llu  %-12s %.4x  %-8s  %-18s %.2x %.2x %.2x %.2x %s ", (unsigned long long)r.time, physical, r.pc,
+      bytes, text, r.a, r.x, r.y, r.s, flags);
+    for(int j=0; j<r.bus_count && j<TRACE_BUS; j++)
+      printf(" %c%.4x=%.2x", r.bus[j].write ? 'w' : 'r', r.bus[j].address, r.bus[j].value);
+    if(r.bus_count > TRACE_BUS)
+      printf(" +%d more", r.bus_count - TRACE_BUS);
+    printf("  [BRR %.4x PRR %.4x DRR %.4x]\n", r.BRR, r.PRR, r.DRR);
+  }
+  fclose(file);
+  return 0;
+}